@@ -0,0 +1,309 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "vsfs_format.h"
+
+#define NIL UINT32_MAX
+#define FLUSH_IOV 64U
+
+struct bentry
+{
+    uint32_t block_no;
+    uint32_t hnext;          // next entry in the same hash bucket
+    uint32_t prev, next;     // LRU neighbours while evictable
+    uint32_t pins;
+    uint8_t dirty;
+    uint8_t held;
+    uint8_t on_lru;          // == evictable: clean, unpinned and not held
+    uint8_t *data;
+};
+
+struct bcache
+{
+    int fd;
+    uint32_t capacity;
+
+    struct bentry *entries;  // slots are reused on eviction, never freed
+    uint32_t count;
+    uint32_t entries_cap;
+
+    uint32_t *buckets;
+    uint32_t nbuckets;
+
+    uint32_t lru_head;       // most recently used evictable entry
+    uint32_t lru_tail;       // next victim
+
+    uint32_t *held;          // entries touched since bcache_hold_begin
+    uint32_t nheld;
+    uint32_t held_cap;
+    int holding;
+
+    struct bcache_stats stats;
+};
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static uint32_t bucket_of(const struct bcache *c, uint32_t block_no)
+{
+    return (block_no * 2654435761U) & (c->nbuckets - 1U);
+}
+
+static uint32_t lookup(const struct bcache *c, uint32_t block_no)
+{
+    uint32_t i = c->buckets[bucket_of(c, block_no)];
+    while (i != NIL && c->entries[i].block_no != block_no) i = c->entries[i].hnext;
+    return i;
+}
+
+static void hash_insert(struct bcache *c, uint32_t i)
+{
+    uint32_t b = bucket_of(c, c->entries[i].block_no);
+    c->entries[i].hnext = c->buckets[b];
+    c->buckets[b] = i;
+}
+
+static void hash_remove(struct bcache *c, uint32_t i)
+{
+    uint32_t *link = &c->buckets[bucket_of(c, c->entries[i].block_no)];
+    while (*link != i) link = &c->entries[*link].hnext;
+    *link = c->entries[i].hnext;
+}
+
+static void lru_unlink(struct bcache *c, uint32_t i)
+{
+    struct bentry *e = &c->entries[i];
+    if (e->prev != NIL) c->entries[e->prev].next = e->next;
+    else c->lru_head = e->next;
+    if (e->next != NIL) c->entries[e->next].prev = e->prev;
+    else c->lru_tail = e->prev;
+    e->on_lru = 0;
+}
+
+static void lru_push_head(struct bcache *c, uint32_t i)
+{
+    struct bentry *e = &c->entries[i];
+    e->prev = NIL;
+    e->next = c->lru_head;
+    if (c->lru_head != NIL) c->entries[c->lru_head].prev = i;
+    else c->lru_tail = i;
+    c->lru_head = i;
+    e->on_lru = 1;
+}
+
+// Puts the entry on the LRU list exactly when it may be evicted.
+static void lru_update(struct bcache *c, uint32_t i)
+{
+    struct bentry *e = &c->entries[i];
+    int evictable = !e->dirty && e->pins == 0 && !e->held;
+    if (evictable && !e->on_lru) lru_push_head(c, i);
+    else if (!evictable && e->on_lru) lru_unlink(c, i);
+}
+
+static void hold(struct bcache *c, uint32_t i)
+{
+    if (!c->holding || c->entries[i].held) return;
+    if (c->nheld == c->held_cap) {
+        c->held_cap = c->held_cap ? 2U * c->held_cap : 64U;
+        c->held = realloc(c->held, c->held_cap * sizeof(*c->held));
+        if (!c->held) die("realloc held blocks");
+    }
+    c->held[c->nheld++] = i;
+    c->entries[i].held = 1;
+    lru_update(c, i);
+}
+
+// Entry for a block that is not cached: a fresh slot while under capacity
+// (or when nothing is evictable), otherwise the least recently used one.
+static uint32_t entry_for(struct bcache *c, uint32_t block_no)
+{
+    uint32_t i;
+    if (c->count < c->capacity || c->lru_tail == NIL) {
+        if (c->count == c->entries_cap) {
+            c->entries_cap = c->entries_cap ? 2U * c->entries_cap : 64U;
+            c->entries = realloc(c->entries, c->entries_cap * sizeof(*c->entries));
+            if (!c->entries) die("realloc block cache");
+        }
+        i = c->count++;
+        c->entries[i].data = malloc(BLOCK_SIZE);
+        if (!c->entries[i].data) die("malloc block cache");
+    } else {
+        i = c->lru_tail;
+        lru_unlink(c, i);
+        hash_remove(c, i);
+        c->stats.evictions++;
+    }
+
+    struct bentry *e = &c->entries[i];
+    e->block_no = block_no;
+    e->pins = 0;
+    e->dirty = 0;
+    e->held = 0;
+    e->on_lru = 0;
+    hash_insert(c, i);
+    return i;
+}
+
+struct bcache *bcache_open(int fd, uint32_t capacity)
+{
+    struct bcache *c = calloc(1, sizeof(*c));
+    if (!c) die("calloc block cache");
+    c->fd = fd;
+    c->capacity = capacity ? capacity : 1U;
+    c->nbuckets = 16U;
+    while (c->nbuckets < 2U * c->capacity) c->nbuckets *= 2U;
+    c->buckets = malloc(c->nbuckets * sizeof(*c->buckets));
+    if (!c->buckets) die("malloc block cache");
+    memset(c->buckets, 0xFF, c->nbuckets * sizeof(*c->buckets));
+    c->lru_head = NIL;
+    c->lru_tail = NIL;
+    return c;
+}
+
+void bcache_close(struct bcache *c)
+{
+    if (!c) return;
+    for (uint32_t i = 0; i < c->count; i++) free(c->entries[i].data);
+    free(c->entries);
+    free(c->buckets);
+    free(c->held);
+    free(c);
+}
+
+const uint8_t *bcache_read(struct bcache *c, uint32_t block_no)
+{
+    uint32_t i = lookup(c, block_no);
+    if (i != NIL) {
+        c->stats.hits++;
+        if (c->entries[i].on_lru && c->lru_head != i) {
+            lru_unlink(c, i);
+            lru_push_head(c, i);
+        }
+    } else {
+        c->stats.misses++;
+        i = entry_for(c, block_no);
+        ssize_t n = pread(c->fd, c->entries[i].data, BLOCK_SIZE, (off_t)block_no * BLOCK_SIZE);
+        if (n != (ssize_t)BLOCK_SIZE) die("pread");
+        lru_update(c, i);
+    }
+    hold(c, i);
+    return c->entries[i].data;
+}
+
+void bcache_put(struct bcache *c, uint32_t block_no, const uint8_t *image)
+{
+    uint32_t i = lookup(c, block_no);
+    if (i == NIL) i = entry_for(c, block_no);
+    if (c->entries[i].data != image) memcpy(c->entries[i].data, image, BLOCK_SIZE);
+    c->entries[i].dirty = 1;
+    lru_update(c, i);
+    hold(c, i);
+}
+
+void bcache_pin(struct bcache *c, uint32_t block_no)
+{
+    bcache_read(c, block_no);
+    uint32_t i = lookup(c, block_no);
+    c->entries[i].pins++;
+    lru_update(c, i);
+}
+
+void bcache_unpin(struct bcache *c, uint32_t block_no)
+{
+    uint32_t i = lookup(c, block_no);
+    if (i == NIL || c->entries[i].pins == 0) return;
+    c->entries[i].pins--;
+    lru_update(c, i);
+}
+
+void bcache_hold_begin(struct bcache *c)
+{
+    c->holding = 1;
+}
+
+void bcache_hold_end(struct bcache *c)
+{
+    for (uint32_t k = 0; k < c->nheld; k++) {
+        c->entries[c->held[k]].held = 0;
+        lru_update(c, c->held[k]);
+    }
+    c->nheld = 0;
+    c->holding = 0;
+}
+
+struct dirty_ref
+{
+    uint32_t block_no;
+    uint32_t entry;
+};
+
+static int cmp_block_no(const void *a, const void *b)
+{
+    uint32_t x = ((const struct dirty_ref *)a)->block_no;
+    uint32_t y = ((const struct dirty_ref *)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+static void pwritev_run(void *ctx, const struct iovec *iov, unsigned iovcnt, uint32_t first_block)
+{
+    struct bcache *c = ctx;
+    ssize_t written = pwritev(c->fd, iov, (int)iovcnt, (off_t)first_block * BLOCK_SIZE);
+    if (written != (ssize_t)iovcnt * (ssize_t)BLOCK_SIZE) die("pwritev");
+    c->stats.write_calls++;
+}
+
+void bcache_flush(struct bcache *c)
+{
+    bcache_flush_to(c, pwritev_run, c);
+}
+
+void bcache_flush_to(struct bcache *c, bcache_writer write, void *ctx)
+{
+    struct dirty_ref *dirty = malloc((c->count ? c->count : 1U) * sizeof(*dirty));
+    if (!dirty) die("malloc flush list");
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        if (!c->entries[i].dirty) continue;
+        dirty[n].block_no = c->entries[i].block_no;
+        dirty[n].entry = i;
+        n++;
+    }
+    qsort(dirty, n, sizeof(*dirty), cmp_block_no);
+
+    uint32_t k = 0;
+    while (k < n) {
+        struct iovec iov[FLUSH_IOV];
+        uint32_t first = dirty[k].block_no;
+        uint32_t run = 0;
+        do {
+            iov[run].iov_base = c->entries[dirty[k + run].entry].data;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        } while (k + run < n && run < FLUSH_IOV && dirty[k + run].block_no == first + run);
+
+        write(ctx, iov, run, first);
+        k += run;
+    }
+
+    for (k = 0; k < n; k++) {
+        c->entries[dirty[k].entry].dirty = 0;
+        lru_update(c, dirty[k].entry);
+    }
+    c->stats.writebacks += n;
+    free(dirty);
+}
+
+void bcache_get_stats(const struct bcache *c, struct bcache_stats *st)
+{
+    *st = c->stats;
+}
@@ -0,0 +1,55 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+// Block cache over an image file, shared by mkfs and the journal library.
+// The validator does not use it: it maps the whole image read-only and
+// looks at each block about once, so a cache would only add copies.
+//
+// Blocks are kept in LRU order up to a soft capacity. Only clean, unpinned
+// blocks that are not held by the current operation are ever evicted, so a
+// pointer returned by bcache_read stays valid while its block is dirty,
+// pinned or held; when nothing can be evicted the cache grows instead.
+// Dirty blocks are written back by bcache_flush, in block order, one
+// pwritev per run of adjacent blocks. I/O errors are fatal.
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct bcache;
+
+struct bcache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;    // blocks written by bcache_flush
+    uint64_t write_calls;   // pwritev calls made by bcache_flush
+};
+
+struct bcache *bcache_open(int fd, uint32_t capacity);
+void bcache_close(struct bcache *c);    // dirty blocks are dropped, not written
+
+const uint8_t *bcache_read(struct bcache *c, uint32_t block_no);
+
+// Replaces the cached contents of block_no and marks it dirty.
+void bcache_put(struct bcache *c, uint32_t block_no, const uint8_t *image);
+
+// Pinned blocks are never evicted; pins nest.
+void bcache_pin(struct bcache *c, uint32_t block_no);
+void bcache_unpin(struct bcache *c, uint32_t block_no);
+
+// Every block read between hold_begin and hold_end stays resident until
+// hold_end, so an operation can keep pointers to all the blocks it looked at.
+void bcache_hold_begin(struct bcache *c);
+void bcache_hold_end(struct bcache *c);
+
+void bcache_flush(struct bcache *c);
+
+// Like bcache_flush, but each run goes to write() instead of pwritev; the
+// block buffers stay valid until the cache is next read or written.
+typedef void (*bcache_writer)(void *ctx, const struct iovec *iov, unsigned iovcnt, uint32_t first_block);
+void bcache_flush_to(struct bcache *c, bcache_writer write, void *ctx);
+
+void bcache_get_stats(const struct bcache *c, struct bcache_stats *st);
+
+#endif
@@ -0,0 +1,264 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vsfs.h"
+#include "vsfs_format.h"
+
+// Create/install benchmark. For every I/O backend and sync mode it formats
+// a fresh image with mkfs and runs the same number of creates three ways:
+// one name per call, BATCH names per call, and THREADS threads sharing one
+// handle (so group commit can merge their calls). Every INSTALL_EVERY
+// creates an install runs inline, in whichever call crossed the mark, and
+// is part of that call's latency.
+
+#define DEFAULT_IMAGE "bench.img"
+#define DEFAULT_MKFS "./mkfs"
+#define DEFAULT_OPS 1000U
+#define DEFAULT_BATCH 16U
+#define DEFAULT_THREADS 8U
+#define DEFAULT_INSTALL_EVERY 100U
+#define DEFAULT_BENCH_JOURNAL_BLOCKS 64U
+#define MAX_THREADS 64U
+#define MAX_OPS (DIR_MAX_ENTRIES - 2U)    // everything goes in the root directory
+
+enum workload { WL_SINGLE, WL_BATCH, WL_CONCURRENT };
+
+static const char *const workload_names[] = { "single", "batch", "concurrent" };
+static const char *const sync_names[] = { "none", "commit", "ordered" };
+static const char *const io_names[] = { "sync", "uring" };
+
+static uint32_t nops = DEFAULT_OPS;
+static uint32_t batch = DEFAULT_BATCH;
+static uint32_t nthreads = DEFAULT_THREADS;
+static uint32_t install_every = DEFAULT_INSTALL_EVERY;
+static uint32_t journal_blocks = DEFAULT_BENCH_JOURNAL_BLOCKS;
+static const char *mkfs_path = DEFAULT_MKFS;
+static const char *image_path = DEFAULT_IMAGE;
+
+struct run {
+    struct vsfs *fs;
+    enum workload wl;
+    uint32_t done;            // creates so far, shared by the threads
+    uint64_t *lat_ns;         // one slot per call
+    uint32_t ncalls;
+};
+
+struct worker {
+    struct run *run;
+    uint32_t first;           // operation numbers [first, last)
+    uint32_t last;
+    uint32_t per_call;        // names per vsfs_create_many
+    uint32_t call;            // first latency slot
+    int failed;
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: ./bench [-n ops] [-b batch] [-t threads] [-k install_every] [-j journal_blocks]\n"
+                    "               [-m mkfs] [image]\n");
+    fprintf(stderr, "  defaults: -n %u -b %u -t %u -k %u (0 = only automatic checkpoints) -j %u,\n"
+                    "            mkfs '%s', image '%s'; ops at most %u\n",
+            DEFAULT_OPS, DEFAULT_BATCH, DEFAULT_THREADS, DEFAULT_INSTALL_EVERY,
+            DEFAULT_BENCH_JOURNAL_BLOCKS, DEFAULT_MKFS, DEFAULT_IMAGE, MAX_OPS);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t parse_count(const char *arg, int allow_zero) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || (v == 0 && !allow_zero) || v > UINT32_MAX) {
+        usage();
+    }
+    return (uint32_t)v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Formats the image with room for every create of a run.
+static void format_image(void) {
+    char jarg[16], iarg[16];
+    snprintf(jarg, sizeof(jarg), "%u", journal_blocks);
+    snprintf(iarg, sizeof(iarg), "%u", nops + 1U);
+
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        execl(mkfs_path, mkfs_path, "-j", jarg, "-i", iarg, image_path, (char *)NULL);
+        perror(mkfs_path);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) die("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s failed\n", mkfs_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct run *run = w->run;
+    char (*buf)[NAME_LEN] = malloc((size_t)w->per_call * NAME_LEN);
+    const char **ptrs = malloc((size_t)w->per_call * sizeof(*ptrs));
+    if (!buf || !ptrs) die("malloc names");
+
+    uint32_t call = w->call;
+    for (uint32_t op = w->first; op < w->last; call++) {
+        uint32_t n = w->last - op < w->per_call ? w->last - op : w->per_call;
+        for (uint32_t i = 0; i < n; i++) {
+            snprintf(buf[i], NAME_LEN, "f%u", op + i);
+            ptrs[i] = buf[i];
+        }
+
+        uint64_t t0 = now_ns();
+        if (vsfs_create_many(run->fs, ptrs, n) != 0) w->failed = 1;
+        uint32_t before = __atomic_fetch_add(&run->done, n, __ATOMIC_RELAXED);
+        if (install_every && (before + n) / install_every != before / install_every) {
+            if (vsfs_install(run->fs) < 0) w->failed = 1;
+        }
+        run->lat_ns[call] = now_ns() - t0;
+        op += n;
+    }
+
+    free(ptrs);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, uint32_t n, unsigned pct) {
+    uint32_t i = (uint32_t)(((uint64_t)n * pct + 99U) / 100U);
+    if (i > 0) i--;
+    return (double)sorted[i] / 1000.0;
+}
+
+// Runs one workload on a fresh image; returns -1 if anything failed and
+// -2 if the I/O backend is not available.
+static int run_one(enum workload wl, enum vsfs_sync sync, enum vsfs_io io) {
+    format_image();
+    struct run run = { vsfs_open(image_path), wl, 0, NULL, 0 };
+    if (!run.fs) return -1;
+    vsfs_set_sync(run.fs, sync);
+    if (vsfs_set_io(run.fs, io) != 0) {
+        vsfs_close(run.fs);
+        return -2;
+    }
+
+    uint32_t workers = wl == WL_CONCURRENT ? nthreads : 1U;
+    uint32_t per_call = wl == WL_BATCH ? batch : 1U;
+    struct worker w[MAX_THREADS];
+    for (uint32_t k = 0; k < workers; k++) {
+        w[k].run = &run;
+        w[k].first = (uint32_t)((uint64_t)nops * k / workers);
+        w[k].last = (uint32_t)((uint64_t)nops * (k + 1U) / workers);
+        w[k].per_call = per_call;
+        w[k].call = run.ncalls;
+        w[k].failed = 0;
+        run.ncalls += (w[k].last - w[k].first + per_call - 1U) / per_call;
+    }
+    run.lat_ns = calloc(run.ncalls ? run.ncalls : 1U, sizeof(*run.lat_ns));
+    if (!run.lat_ns) die("calloc latencies");
+
+    struct vsfs_stats before, after;
+    vsfs_get_stats(run.fs, &before);
+    uint64_t t0 = now_ns();
+    if (workers == 1U) {
+        worker_main(&w[0]);
+    } else {
+        pthread_t tid[MAX_THREADS];
+        for (uint32_t k = 0; k < workers; k++) {
+            if (pthread_create(&tid[k], NULL, worker_main, &w[k]) != 0) die("pthread_create");
+        }
+        for (uint32_t k = 0; k < workers; k++) pthread_join(tid[k], NULL);
+    }
+    uint64_t elapsed = now_ns() - t0;
+    vsfs_get_stats(run.fs, &after);
+    vsfs_close(run.fs);
+
+    int failed = 0;
+    for (uint32_t k = 0; k < workers; k++) failed |= w[k].failed;
+
+    qsort(run.lat_ns, run.ncalls, sizeof(*run.lat_ns), cmp_u64);
+    double ops = (double)nops;
+    printf("%-10s %-7s %-5s %10.0f %9.1f %9.1f %9.1f %8.2f %8llu%s\n",
+           workload_names[wl], sync_names[sync], io_names[io],
+           ops / ((double)elapsed / 1e9),
+           percentile_us(run.lat_ns, run.ncalls, 50), percentile_us(run.lat_ns, run.ncalls, 99),
+           (double)(after.journal_bytes - before.journal_bytes) / ops,
+           (double)(after.syscalls - before.syscalls) / ops,
+           (unsigned long long)(after.commits - before.commits),
+           failed ? "  (errors)" : "");
+    fflush(stdout);
+    free(run.lat_ns);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:t:k:j:m:h")) != -1) {
+        switch (opt) {
+        case 'n': nops = parse_count(optarg, 0); break;
+        case 'b': batch = parse_count(optarg, 0); break;
+        case 't': nthreads = parse_count(optarg, 0); break;
+        case 'k': install_every = parse_count(optarg, 1); break;
+        case 'j': journal_blocks = parse_count(optarg, 0); break;
+        case 'm': mkfs_path = optarg; break;
+        default: usage();
+        }
+    }
+    if (argc - optind > 1 || nops > MAX_OPS || nthreads > MAX_THREADS) {
+        usage();
+    }
+    if (optind < argc) image_path = argv[optind];
+    if (access(mkfs_path, X_OK) != 0) {
+        fprintf(stderr, "bench: cannot run %s: %s (build it with: gcc -o mkfs mkfs.c bcache.c)\n",
+                mkfs_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("%u creates per run, batch %u, %u threads, install every %u\n\n",
+           nops, batch, nthreads, install_every);
+    printf("%-10s %-7s %-5s %10s %9s %9s %9s %8s %8s\n",
+           "workload", "sync", "io", "ops/s", "p50 us", "p99 us", "jbytes/op", "calls/op", "commits");
+
+    int rc = EXIT_SUCCESS;
+    for (int io = VSFS_IO_SYNC; io <= VSFS_IO_URING; io++) {
+        for (int sync = VSFS_SYNC_NONE; sync <= VSFS_SYNC_ORDERED; sync++) {
+            for (int wl = WL_SINGLE; wl <= WL_CONCURRENT; wl++) {
+                int r = run_one((enum workload)wl, (enum vsfs_sync)sync, (enum vsfs_io)io);
+                if (r == -2) {
+                    printf("io_uring unavailable, skipping the uring runs\n");
+                    goto done;
+                }
+                if (r != 0) rc = EXIT_FAILURE;
+            }
+        }
+    }
+done:
+    if (unlink(image_path) != 0) die("unlink");
+    return rc;
+}
@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -7,112 +8,102 @@
 #include <time.h>
 #include <unistd.h>
 
-#define FS_MAGIC 0x56534653U
-
-#define BLOCK_SIZE        4096U
-#define INODE_SIZE         128U
-#define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
-#define DEFAULT_IMAGE "vsfs.img"
-
-struct superblock {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
-    uint32_t inode_count;
-
-    uint32_t journal_block;
-    uint32_t inode_bitmap;
-    uint32_t data_bitmap;
-    uint32_t inode_start;
-    uint32_t data_start;
-
-    uint8_t  _pad[128 - 9 * 4];
-};
-
-struct inode {
-    uint16_t type;
-    uint16_t links;
-    uint32_t size;
+#include "vsfs_format.h"
+#include "vsfs_bitmap.h"
+#include "bcache.h"
 
-    uint32_t direct[8];
-
-    uint32_t ctime;
-    uint32_t mtime;
+#define DEFAULT_IMAGE "vsfs.img"
 
-    uint8_t _pad[128 - (2 + 2 + 4 + 8 * 4 + 4 + 4)];
-};
+// Blocks that are not all zeros: superblock, first block of each bitmap,
+// first inode table block, the root directory block and its index.
+#define MAX_META_BLOCKS 6
 
-struct dirent {
-    uint32_t inode;
-    char name[28];
+struct meta_block {
+    uint32_t block_no;
+    uint8_t *data;
 };
 
-_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
-_Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
-_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
-
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void write_block(int fd, const void *block) {
-    ssize_t written = write(fd, block, BLOCK_SIZE);
-    if (written != (ssize_t)BLOCK_SIZE) {
-        die("write");
-    }
+static void usage(void) {
+    fprintf(stderr, "Usage: ./mkfs [-j journal_blocks] [-i inode_count] [-d data_blocks] [image]\n");
+    fprintf(stderr, "  defaults: -j %u -i %u -d %u, image '%s'\n",
+            DEFAULT_JOURNAL_BLOCKS, DEFAULT_INODE_COUNT, DEFAULT_DATA_BLOCKS, DEFAULT_IMAGE);
+    exit(EXIT_FAILURE);
 }
 
-static void set_bitmap(uint8_t *bitmap, uint32_t index) {
-    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+static uint32_t parse_count(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || v == 0 || v > UINT32_MAX) {
+        usage();
+    }
+    return (uint32_t)v;
 }
 
 int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+    uint32_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    uint32_t inode_count = DEFAULT_INODE_COUNT;
+    uint32_t data_blocks = DEFAULT_DATA_BLOCKS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:i:d:h")) != -1) {
+        switch (opt) {
+        case 'j': journal_blocks = parse_count(optarg); break;
+        case 'i': inode_count = parse_count(optarg); break;
+        case 'd': data_blocks = parse_count(optarg); break;
+        default: usage();
+        }
+    }
+    if (argc - optind > 1) {
+        usage();
+    }
+    const char *image_path = (optind < argc) ? argv[optind] : DEFAULT_IMAGE;
+
+    struct vsfs_geometry geo;
+    const char *err = vsfs_geometry_make(&geo, journal_blocks, inode_count, data_blocks);
+    if (err) {
+        fprintf(stderr, "mkfs: %s\n", err);
+        return EXIT_FAILURE;
+    }
 
     int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
     if (fd < 0) {
         die("open");
     }
 
-    uint8_t block[BLOCK_SIZE];
-    memset(block, 0, sizeof(block));
-
-    struct superblock sb = {
-        .magic = FS_MAGIC,
-        .block_size = BLOCK_SIZE,
-        .total_blocks = TOTAL_BLOCKS,
-        .inode_count = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE),
-        .journal_block = JOURNAL_BLOCK_IDX,
-        .inode_bitmap = INODE_BMAP_IDX,
-        .data_bitmap = DATA_BMAP_IDX,
-        .inode_start = INODE_START_IDX,
-        .data_start = DATA_START_IDX,
-    };
-
-    memcpy(block, &sb, sizeof(sb));
-    write_block(fd, block); // Superblock
-
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+    // Everything not written below reads back as zeros; on most file
+    // systems those regions are not even allocated.
+    if (ftruncate(fd, (off_t)geo.total_blocks * BLOCK_SIZE) < 0) {
+        die("ftruncate");
     }
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve inode 0 for root
-    write_block(fd, block); // Inode bitmap
-
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve first data block for root directory
-    write_block(fd, block); // Data bitmap
+    static uint8_t blocks[MAX_META_BLOCKS][BLOCK_SIZE];
+    struct meta_block meta[MAX_META_BLOCKS];
+    int nmeta = 0;
+
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    vsfs_geometry_to_sb(&geo, &sb);
+    memcpy(blocks[nmeta], &sb, sizeof(sb));
+    meta[nmeta].block_no = SB_BLOCK_NO;
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
+
+    vsfs_bitmap_set(blocks[nmeta], 0); // Reserve inode 0 for root
+    meta[nmeta].block_no = geo.inode_bmap_start;
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
+
+    vsfs_bitmap_set(blocks[nmeta], 0); // Reserve first data block for root directory
+    vsfs_bitmap_set(blocks[nmeta], 1); // and the second for its name index
+    meta[nmeta].block_no = geo.data_bmap_start;
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
 
     time_t now = time(NULL);
 
@@ -120,37 +111,54 @@ int main(int argc, char *argv[]) {
     root.type = 2; // directory
     root.links = 2; // "." and ".."
     root.size = 2 * sizeof(struct dirent);
-    memset(root.direct, 0, sizeof(root.direct));
-    root.direct[0] = DATA_START_IDX;
+    root.flags = INODE_FLAG_EXTENTS;
+    root.extents[0].start = geo.data_start;
+    root.extents[0].len = 1;
     root.ctime = (uint32_t)now;
     root.mtime = (uint32_t)now;
+    root.index_block = geo.data_start + 1;
 
-    memset(block, 0, sizeof(block));
-    memcpy(block, &root, sizeof(root));
-    write_block(fd, block); // First inode block
-
-    memset(block, 0, sizeof(block));
-    write_block(fd, block); // Second inode block
+    memcpy(blocks[nmeta], &root, sizeof(root));
+    meta[nmeta].block_no = geo.inode_start; // First inode block
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
 
-    memset(block, 0, sizeof(block));
-    struct dirent *root_dirents = (struct dirent *)block;
+    struct dirent *root_dirents = (struct dirent *)blocks[nmeta];
     root_dirents[0].inode = 0;
     strncpy(root_dirents[0].name, ".", sizeof(root_dirents[0].name) - 1);
     root_dirents[0].name[sizeof(root_dirents[0].name) - 1] = '\0';
     root_dirents[1].inode = 0;
     strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
     root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
-    write_block(fd, block); // First data block holds root directory entries
-
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
-        write_block(fd, block);
+    meta[nmeta].block_no = geo.data_start; // First data block holds root directory entries
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
+
+    uint16_t index_slots[DIR_INDEX_SLOTS] = {0};
+    for (uint32_t pos = 0; pos < 2; ++pos) {
+        uint32_t slot = vsfs_dir_index_home(root_dirents[pos].name);
+        while (index_slots[slot] != 0) {
+            slot = vsfs_dir_index_next(slot);
+        }
+        index_slots[slot] = (uint16_t)(pos + 1);
+    }
+    memcpy(blocks[nmeta], index_slots, sizeof(index_slots));
+    meta[nmeta].block_no = root.index_block;
+    meta[nmeta].data = blocks[nmeta];
+    nmeta++;
+
+    // the cache writes them back in block order, one pwritev per adjacent run
+    struct bcache *cache = bcache_open(fd, MAX_META_BLOCKS);
+    for (int i = 0; i < nmeta; ++i) {
+        bcache_put(cache, meta[i].block_no, meta[i].data);
     }
+    bcache_flush(cache);
+    bcache_close(cache);
 
     if (close(fd) < 0) {
         die("close");
     }
 
-    printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
+    printf("Created VSFS image '%s' (%u blocks).\n", image_path, geo.total_blocks);
     return 0;
 }
@@ -0,0 +1,236 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// What a queued op needs to stay alive until it completes.
+struct uring_op
+{
+    uint32_t expect;                       // bytes a write must report
+    struct iovec iov[URING_MAX_IOV];
+    uint8_t inline_buf[URING_INLINE_BYTES];
+};
+
+struct uring
+{
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    unsigned queued;                       // SQEs filled since the last uring_run
+    uint64_t enters;
+    struct uring_op *ops;                  // indexed by SQE slot, which is also user_data
+};
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+struct uring *uring_open(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) return NULL;
+
+    struct uring *r = calloc(1, sizeof(*r));
+    if (!r) die("calloc uring");
+    r->fd = fd;
+    r->entries = p.sq_entries;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) die("mmap io_uring sq");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) die("mmap io_uring cq");
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) die("mmap io_uring sqes");
+
+    uint8_t *sq = r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    uint8_t *cq = r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->ops = calloc(r->entries, sizeof(*r->ops));
+    if (!r->ops) die("calloc uring ops");
+    return r;
+}
+
+void uring_close(struct uring *r)
+{
+    if (!r) return;
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_len);
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+    free(r->ops);
+    free(r);
+}
+
+// Next free SQE; a full ring is run to completion first, which orders the
+// ops at least as strictly as any link would have.
+static struct io_uring_sqe *next_sqe(struct uring *r, struct uring_op **op)
+{
+    if (r->queued == r->entries) uring_run(r);
+
+    unsigned tail = *r->sq_tail + r->queued;
+    unsigned slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = slot;
+    r->sq_array[slot] = slot;
+    r->queued++;
+    *op = &r->ops[slot];
+    return sqe;
+}
+
+static uint8_t sqe_flags(unsigned flags)
+{
+    uint8_t f = 0;
+    if (flags & URING_LINK) f |= IOSQE_IO_LINK;
+    if (flags & URING_DRAIN) f |= IOSQE_IO_DRAIN;
+    return f;
+}
+
+void uring_writev(struct uring *r, int fd, const struct iovec *iov, unsigned iovcnt, off_t off, unsigned flags)
+{
+    if (iovcnt > URING_MAX_IOV) {
+        fprintf(stderr, "uring: %u iovecs exceed the limit of %u\n", iovcnt, URING_MAX_IOV);
+        exit(1);
+    }
+    struct uring_op *op;
+    struct io_uring_sqe *sqe = next_sqe(r, &op);
+    op->expect = 0;
+    for (unsigned i = 0; i < iovcnt; i++) {
+        op->iov[i] = iov[i];
+        op->expect += (uint32_t)iov[i].iov_len;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->flags = sqe_flags(flags);
+    sqe->fd = fd;
+    sqe->off = (uint64_t)off;
+    sqe->addr = (uint64_t)(uintptr_t)op->iov;
+    sqe->len = iovcnt;
+}
+
+void uring_write(struct uring *r, int fd, const void *buf, uint32_t len, off_t off, unsigned flags)
+{
+    struct iovec iov = { (void *)buf, len };
+    uring_writev(r, fd, &iov, 1, off, flags);
+
+    // the op was just queued in the slot before the tail
+    unsigned slot = (*r->sq_tail + r->queued - 1U) & *r->sq_mask;
+    struct uring_op *op = &r->ops[slot];
+    if (len <= URING_INLINE_BYTES) {
+        memcpy(op->inline_buf, buf, len);
+        op->iov[0].iov_base = op->inline_buf;
+    }
+}
+
+void uring_fdatasync(struct uring *r, int fd, unsigned flags)
+{
+    struct uring_op *op;
+    struct io_uring_sqe *sqe = next_sqe(r, &op);
+    op->expect = 0;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = sqe_flags(flags);
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+void uring_run(struct uring *r)
+{
+    if (r->queued == 0) return;
+
+    // a link out of the last op would reach into the next batch
+    unsigned last = (*r->sq_tail + r->queued - 1U) & *r->sq_mask;
+    r->sqes[last].flags &= (uint8_t)~IOSQE_IO_LINK;
+
+    unsigned n = r->queued;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->queued = 0;
+
+    unsigned submitted = 0, completed = 0;
+    while (completed < n) {
+        int rc = sys_io_uring_enter(r->fd, n - submitted, 1, IORING_ENTER_GETEVENTS);
+        r->enters++;
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            die("io_uring_enter");
+        }
+        submitted += (unsigned)rc;
+        if (submitted > n) submitted = n;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            const struct uring_op *op = &r->ops[cqe->user_data];
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                die("io_uring");
+            }
+            if ((uint32_t)cqe->res != op->expect) {
+                fprintf(stderr, "io_uring: short write (%d of %u bytes)\n", cqe->res, op->expect);
+                exit(1);
+            }
+            completed++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+uint64_t uring_syscalls(const struct uring *r)
+{
+    return r->enters;
+}
@@ -0,0 +1,39 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal io_uring submission layer, on the raw system calls.
+//
+// Writes and fdatasyncs are queued and then submitted together by
+// uring_run, which waits for all of them. An op queued with URING_LINK
+// makes the next one wait until it has completed; URING_DRAIN makes an op
+// wait for everything queued before it. Short writes and I/O errors are
+// fatal, as with the synchronous helpers.
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_LINK   1U
+#define URING_DRAIN  2U
+
+#define URING_MAX_IOV 64U
+
+struct uring;
+
+// NULL when the kernel does not provide io_uring.
+struct uring *uring_open(unsigned entries);
+void uring_close(struct uring *r);
+
+// Buffers of up to URING_INLINE_BYTES are copied; larger ones must stay
+// valid until uring_run returns.
+#define URING_INLINE_BYTES 32U
+void uring_write(struct uring *r, int fd, const void *buf, uint32_t len, off_t off, unsigned flags);
+void uring_writev(struct uring *r, int fd, const struct iovec *iov, unsigned iovcnt, off_t off, unsigned flags);
+void uring_fdatasync(struct uring *r, int fd, unsigned flags);
+
+void uring_run(struct uring *r);
+
+// io_uring_enter calls made so far.
+uint64_t uring_syscalls(const struct uring *r);
+
+#endif
@@ -1,66 +1,53 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define FS_MAGIC 0x56534653U
-
-#define BLOCK_SIZE        4096U
-#define INODE_SIZE         128U
-#define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
-#define DIRECT_POINTERS     8U
+#include "vsfs.h"
+#include "vsfs_format.h"
+#include "vsfs_bitmap.h"
+
 #define DEFAULT_IMAGE "vsfs.img"
 
-struct superblock {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
-    uint32_t inode_count;
+// Work is split into fixed chunks so the error output does not depend on
+// how many threads ran them.
+#define INODES_PER_TASK  4096U
+#define BITS_PER_TASK    BITS_PER_BLOCK
+#define MAX_THREADS        64U
 
-    uint32_t journal_block;
-    uint32_t inode_bitmap;
-    uint32_t data_bitmap;
-    uint32_t inode_start;
-    uint32_t data_start;
+static int error_count = 0;
 
-    uint8_t  _pad[128 - 9 * 4];
+// Errors found by a task are buffered and printed in task order once the
+// phase is over; outside a phase they go straight to stderr.
+struct err_buf {
+    char *text;
+    size_t len;
+    size_t cap;
+    int count;
 };
 
-struct inode {
-    uint16_t type;
-    uint16_t links;
-    uint32_t size;
-
-    uint32_t direct[DIRECT_POINTERS];
+static __thread struct err_buf *thread_errs;
 
-    uint32_t ctime;
-    uint32_t mtime;
+// The whole image is mapped once; every block is read through here.
+static const uint8_t *image_base;
+static uint32_t image_blocks;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
-};
-
-struct dirent {
-    uint32_t inode;
-    char name[28];
+// With --with-journal, blocks the committed journal would install shadow
+// the mapping. Sorted by block number.
+struct overlay_block {
+    uint32_t block_no;
+    uint8_t *image;
 };
 
-_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
-_Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
-_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
-
-static int error_count = 0;
+static struct overlay_block *overlay;
+static uint32_t overlay_count;
 
 static void die(const char *msg) {
     perror(msg);
@@ -69,93 +56,305 @@ static void die(const char *msg) {
 
 static void report_error(const char *fmt, ...) {
     va_list ap;
+    struct err_buf *e = thread_errs;
+    if (!e) {
+        va_start(ap, fmt);
+        fputs("ERROR: ", stderr);
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        va_end(ap);
+        error_count++;
+        return;
+    }
+
     va_start(ap, fmt);
-    fputs("ERROR: ", stderr);
-    vfprintf(stderr, fmt, ap);
-    fputc('\n', stderr);
+    int n = vsnprintf(NULL, 0, fmt, ap);
     va_end(ap);
-    error_count++;
+    size_t need = e->len + sizeof("ERROR: \n") + (size_t)n;
+    if (need > e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 256;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *text = realloc(e->text, cap);
+        if (!text) {
+            die("realloc error buffer");
+        }
+        e->text = text;
+        e->cap = cap;
+    }
+    e->len += (size_t)sprintf(e->text + e->len, "ERROR: ");
+    va_start(ap, fmt);
+    e->len += (size_t)vsprintf(e->text + e->len, fmt, ap);
+    va_end(ap);
+    e->text[e->len++] = '\n';
+    e->text[e->len] = '\0';
+    e->count++;
 }
 
-static void pread_block(int fd, uint32_t block_index, void *buf) {
-    off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
-    if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+static void flush_errors(struct err_buf *e) {
+    if (e->len) {
+        fwrite(e->text, 1, e->len, stderr);
     }
+    error_count += e->count;
+    free(e->text);
+    memset(e, 0, sizeof(*e));
 }
 
-static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
-    return (bitmap[index / 8] >> (index % 8)) & 0x1;
+static void overlay_add(void *ctx, uint32_t block_no, const uint8_t *image) {
+    uint32_t *cap = ctx;
+    if (overlay_count == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        overlay = realloc(overlay, *cap * sizeof(*overlay));
+        if (!overlay) {
+            die("realloc overlay");
+        }
+    }
+    uint8_t *copy = malloc(BLOCK_SIZE);
+    if (!copy) {
+        die("malloc overlay block");
+    }
+    memcpy(copy, image, BLOCK_SIZE);
+    overlay[overlay_count].block_no = block_no;
+    overlay[overlay_count].image = copy;
+    overlay_count++;
 }
 
-static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name) {
-    uint32_t total_bits = BLOCK_SIZE * 8;
-    for (uint32_t bit = valid_bits; bit < total_bits; ++bit) {
-        if (bitmap_test(bitmap, bit)) {
-            report_error("%s bitmap has stray bit set at %u", name, bit);
-            return;
+static int overlay_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct overlay_block *)a)->block_no;
+    uint32_t y = ((const struct overlay_block *)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+// Index of the first overlay block numbered >= block_index.
+static uint32_t overlay_lower_bound(uint32_t block_index) {
+    uint32_t lo = 0, hi = overlay_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (overlay[mid].block_no < block_index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const uint8_t *block_at(uint32_t block_index) {
+    if (block_index >= image_blocks) {
+        return NULL;
+    }
+    if (overlay_count) {
+        uint32_t i = overlay_lower_bound(block_index);
+        if (i < overlay_count && overlay[i].block_no == block_index) {
+            return overlay[i].image;
+        }
+    }
+    return image_base + (size_t)block_index * BLOCK_SIZE;
+}
+
+// A multi-block region as one buffer: the mapping itself, or a private
+// copy when the overlay replaces any of its blocks.
+static const uint8_t *region_at(uint32_t start, uint32_t nblocks) {
+    uint32_t i = overlay_lower_bound(start);
+    if (i == overlay_count || overlay[i].block_no >= start + nblocks) {
+        return block_at(start);
+    }
+    uint8_t *copy = malloc((size_t)nblocks * BLOCK_SIZE);
+    if (!copy) {
+        die("malloc region");
+    }
+    memcpy(copy, image_base + (size_t)start * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+    for (; i < overlay_count && overlay[i].block_no < start + nblocks; ++i) {
+        memcpy(copy + (size_t)(overlay[i].block_no - start) * BLOCK_SIZE, overlay[i].image, BLOCK_SIZE);
+    }
+    return copy;
+}
+
+static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t total_bits, uint32_t valid_bits, const char *name) {
+    uint32_t bit = vsfs_bitmap_find_set(bitmap, valid_bits, total_bits);
+    if (bit < total_bits) {
+        report_error("%s bitmap has stray bit set at %u", name, bit);
+    }
+}
+
+// Packs used[base, base + 8), each 0 or 1, into one bitmap byte: the
+// multiply moves byte j of the little-endian load to bit 56 + j.
+static uint64_t pack_used_byte(const uint8_t *used, uint32_t base) {
+    uint64_t x;
+    memcpy(&x, used + base, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return (x * 0x0102040810204080ULL) >> 56;
+}
+
+// First bit in [from, to) where the bitmap disagrees with used[], or to,
+// comparing a 64-bit word at a time.
+static uint32_t bitmap_next_mismatch(const uint8_t *bm, const uint8_t *used, uint32_t from, uint32_t to) {
+    while (from < to) {
+        uint32_t w = from / 64U;
+        uint32_t base = w * 64U;
+        uint32_t n = to - base < 64U ? to - base : 64U;
+        uint64_t expect = 0;
+        uint32_t j = 0;
+        for (; j + 8U <= n; j += 8U) {
+            expect |= pack_used_byte(used, base + j) << j;
+        }
+        for (; j < n; ++j) {
+            expect |= (uint64_t)used[base + j] << j;
         }
+        uint64_t diff = (vsfs_bitmap_word(bm, w) ^ expect) & (~(uint64_t)0 << (from - base));
+        if (n < 64U) {
+            diff &= ((uint64_t)1 << n) - 1U;
+        }
+        if (diff != 0) {
+            return base + (uint32_t)__builtin_ctzll(diff);
+        }
+        from = base + n;
     }
+    return to;
 }
 
-static void validate_superblock(const struct superblock *sb) {
+// The layout is whatever mkfs recorded; only its internal consistency is
+// checked here. Returns -1 when the regions cannot be located at all.
+static int validate_superblock(const struct superblock *sb, struct vsfs_geometry *geo) {
     if (sb->magic != FS_MAGIC) {
         report_error("invalid superblock magic 0x%08x", sb->magic);
+        return -1;
     }
     if (sb->block_size != BLOCK_SIZE) {
         report_error("unexpected block size %u", sb->block_size);
+        return -1;
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        report_error("unexpected total blocks %u", sb->total_blocks);
+    const char *err = vsfs_geometry_from_sb(sb, geo);
+    if (err) {
+        report_error("%s", err);
+        return -1;
     }
-    uint32_t expected_inodes = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE);
-    if (sb->inode_count != expected_inodes) {
-        report_error("unexpected inode count %u", sb->inode_count);
+    return 0;
+}
+
+// Extent i of an extent-mapped inode, NULL past the storage for its list or
+// if the extent block is beyond the image.
+static const struct extent *extent_at(const struct inode *inode, uint32_t i) {
+    if (i < INODE_EXTENTS) {
+        return &inode->extents[i];
     }
-    if (sb->journal_block != JOURNAL_BLOCK_IDX) {
-        report_error("journal block index mismatch %u", sb->journal_block);
+    if (inode->extent_block == 0 || i - INODE_EXTENTS >= EXTENTS_PER_BLOCK) {
+        return NULL;
     }
-    if (sb->inode_bitmap != INODE_BMAP_IDX) {
-        report_error("inode bitmap index mismatch %u", sb->inode_bitmap);
+    const uint8_t *blk = block_at(inode->extent_block);
+    return blk ? (const struct extent *)blk + (i - INODE_EXTENTS) : NULL;
+}
+
+// Disk block holding block fblk of the file, 0 if it has none.
+static uint32_t file_block(const struct inode *inode, uint32_t fblk) {
+    if (!(inode->flags & INODE_FLAG_EXTENTS)) {
+        return fblk < DIRECT_POINTERS ? inode->direct[fblk] : 0;
     }
-    if (sb->data_bitmap != DATA_BMAP_IDX) {
-        report_error("data bitmap index mismatch %u", sb->data_bitmap);
+    const struct extent *e;
+    for (uint32_t i = 0; (e = extent_at(inode, i)) != NULL && e->len != 0; ++i) {
+        if (fblk < e->len) {
+            return e->start + fblk;
+        }
+        fblk -= e->len;
     }
-    if (sb->inode_start != INODE_START_IDX) {
-        report_error("inode start index mismatch %u", sb->inode_start);
+    return 0;
+}
+
+// Every named entry must be reachable by probing from its hash slot, every
+// occupied slot must name a live entry, and no name may appear twice.
+static void check_dir_index(const struct inode *inode,
+                            uint32_t inode_index,
+                            const struct dirent *ents,
+                            uint32_t nents) {
+    uint16_t slots[DIR_INDEX_SLOTS];
+    memcpy(slots, block_at(inode->index_block), sizeof(slots));
+
+    uint8_t indexed[DIR_MAX_ENTRIES] = {0};
+    for (uint32_t s = 0; s < DIR_INDEX_SLOTS; ++s) {
+        if (slots[s] == 0) {
+            continue;
+        }
+        uint32_t pos = slots[s] - 1U;
+        if (pos >= nents || ents[pos].name[0] == '\0') {
+            report_error("inode %u index slot %u points to unused entry %u", inode_index, s, pos);
+            continue;
+        }
+        if (indexed[pos]) {
+            report_error("inode %u index lists entry %u twice", inode_index, pos);
+        }
+        indexed[pos] = 1;
     }
-    if (sb->data_start != DATA_START_IDX) {
-        report_error("data start index mismatch %u", sb->data_start);
+
+    for (uint32_t pos = 0; pos < nents; ++pos) {
+        const struct dirent *de = &ents[pos];
+        if (de->name[0] == '\0' || memchr(de->name, '\0', sizeof(de->name)) == NULL) {
+            continue;
+        }
+        int found = 0;
+        uint32_t s = vsfs_dir_index_home(de->name);
+        uint32_t probes = 0;
+        for (; slots[s] != 0 && probes < DIR_INDEX_SLOTS; s = vsfs_dir_index_next(s), ++probes) {
+            uint32_t other = slots[s] - 1U;
+            if (other == pos) {
+                found = 1;
+                break;
+            }
+            if (other < nents && strncmp(ents[other].name, de->name, NAME_LEN) == 0) {
+                report_error("inode %u directory has duplicate name '%s'", inode_index, de->name);
+            }
+        }
+        if (!found && probes == DIR_INDEX_SLOTS) {
+            report_error("inode %u directory index full/corrupt: no empty slot after %u probes",
+                         inode_index, DIR_INDEX_SLOTS);
+            return;
+        }
+        if (!found) {
+            report_error("inode %u entry '%s' is not reachable through the index", inode_index, de->name);
+        }
     }
 }
 
-static void check_directory(int fd,
-                            const struct inode *inode,
+static void check_directory(const struct inode *inode,
                             uint32_t inode_index,
                             const uint8_t *inode_used,
                             uint32_t inode_count,
-                            uint32_t *link_refs) {
+                            uint32_t *link_refs,
+                            int check_index) {
     if (inode->size % sizeof(struct dirent) != 0) {
         report_error("inode %u directory size %u is not dirent-aligned", inode_index, inode->size);
         return;
     }
 
     uint32_t bytes_remaining = inode->size;
-    uint8_t block[BLOCK_SIZE];
+    struct dirent *ents = calloc(DIR_MAX_ENTRIES, sizeof(struct dirent));
+    if (!ents) {
+        die("calloc dirents");
+    }
+    uint32_t nents = 0;
     int saw_dot = 0;
     int saw_dotdot = 0;
 
-    for (uint32_t i = 0; i < DIRECT_POINTERS && bytes_remaining > 0; ++i) {
-        uint32_t blk = inode->direct[i];
+    for (uint32_t i = 0; i < DIR_MAX_BLOCKS && bytes_remaining > 0; ++i) {
+        uint32_t blk = file_block(inode, i);
         if (blk == 0) {
             report_error("inode %u directory missing data block for bytes still remaining", inode_index);
+            free(ents);
+            return;
+        }
+        const uint8_t *data = block_at(blk);
+        if (!data) {
+            report_error("inode %u directory block %u is beyond the end of the image", inode_index, blk);
+            free(ents);
             return;
         }
-        pread_block(fd, blk, block);
+        struct dirent *entries_ptr = &ents[i * DIRENTS_PER_BLOCK];
+        memcpy(entries_ptr, data, BLOCK_SIZE);
         uint32_t chunk = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
         uint32_t entries = chunk / sizeof(struct dirent);
-        const struct dirent *entries_ptr = (const struct dirent *)block;
+        nents += entries;
         for (uint32_t e = 0; e < entries; ++e) {
             const struct dirent *de = &entries_ptr[e];
             if (de->inode == 0 && de->name[0] == '\0') {
@@ -190,7 +389,7 @@ static void check_directory(int fd,
     }
 
     if (bytes_remaining != 0) {
-        report_error("inode %u directory uses more data than direct pointers cover", inode_index);
+        report_error("inode %u directory is larger than %u blocks", inode_index, DIR_MAX_BLOCKS);
     }
     if (inode->size > 0) {
         if (!saw_dot) {
@@ -200,58 +399,170 @@ static void check_directory(int fd,
             report_error("inode %u directory missing '..' entry", inode_index);
         }
     }
+    if (check_index && inode->index_block != 0) {
+        check_dir_index(inode, inode_index, ents, nents);
+    }
+    free(ents);
 }
 
-int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+struct claim {
+    uint32_t data_idx;
+    uint32_t inode;
+};
 
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0) {
-        die("open");
+struct task {
+    struct err_buf errs;
+    struct claim *claims;   // data blocks referenced by this task's inodes, in inode order
+    size_t nclaims;
+    size_t claims_cap;
+};
+
+struct worker {
+    pthread_t tid;
+    uint32_t *link_refs;    // directory references counted by this thread
+    struct validation *v;
+};
+
+struct validation {
+    struct vsfs_geometry geo;
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    const struct inode *inodes;
+    uint8_t *inode_used;
+    int *data_owner;
+    uint8_t *data_blocks_referenced;
+
+    unsigned nthreads;
+    struct worker workers[MAX_THREADS];
+
+    // current phase
+    void (*run)(struct validation *v, struct worker *w, uint32_t index, struct task *t);
+    struct task *tasks;
+    uint32_t ntasks;
+    uint32_t next_task;
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct validation *v = w->v;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&v->next_task, 1U, __ATOMIC_RELAXED);
+        if (i >= v->ntasks) {
+            break;
+        }
+        thread_errs = &v->tasks[i].errs;
+        v->run(v, w, i, &v->tasks[i]);
+        thread_errs = NULL;
     }
+    return NULL;
+}
 
-    struct superblock sb;
-    pread_block(fd, 0, &sb);
-    validate_superblock(&sb);
+// Runs ntasks tasks across the workers, then reports their errors in task
+// order. The returned tasks still hold their claims.
+static struct task *run_phase(struct validation *v,
+                              void (*run)(struct validation *, struct worker *, uint32_t, struct task *),
+                              uint32_t ntasks) {
+    struct task *tasks = calloc(ntasks ? ntasks : 1, sizeof(*tasks));
+    if (!tasks) {
+        die("calloc tasks");
+    }
+    v->run = run;
+    v->tasks = tasks;
+    v->ntasks = ntasks;
+    v->next_task = 0;
+
+    unsigned nthreads = v->nthreads < ntasks ? v->nthreads : (ntasks ? ntasks : 1);
+    if (nthreads <= 1) {
+        worker_main(&v->workers[0]);
+    } else {
+        for (unsigned t = 0; t < nthreads; ++t) {
+            if (pthread_create(&v->workers[t].tid, NULL, worker_main, &v->workers[t]) != 0) {
+                die("pthread_create");
+            }
+        }
+        for (unsigned t = 0; t < nthreads; ++t) {
+            pthread_join(v->workers[t].tid, NULL);
+        }
+    }
 
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    for (uint32_t i = 0; i < ntasks; ++i) {
+        flush_errors(&tasks[i].errs);
+    }
+    return tasks;
+}
 
-    uint32_t inode_count = sb.inode_count;
-    uint32_t total_inode_bytes = INODE_BLOCKS * BLOCK_SIZE;
-    uint8_t *inode_area = malloc(total_inode_bytes);
-    if (!inode_area) {
-        die("malloc inode area");
+static void free_tasks(struct task *tasks, uint32_t ntasks) {
+    for (uint32_t i = 0; i < ntasks; ++i) {
+        free(tasks[i].claims);
     }
-    for (uint32_t i = 0; i < INODE_BLOCKS; ++i) {
-        pread_block(fd, INODE_START_IDX + i, inode_area + (i * BLOCK_SIZE));
+    free(tasks);
+}
+
+static void task_range(uint32_t index, uint32_t per_task, uint32_t total, uint32_t *lo, uint32_t *hi) {
+    *lo = index * per_task;
+    *hi = (total - *lo > per_task) ? *lo + per_task : total;
+}
+
+static void claim_data_block(struct validation *v, struct task *t, uint32_t inode_index, uint32_t blk) {
+    if (blk < v->geo.data_start || blk >= v->geo.data_start + v->geo.data_blocks) {
+        report_error("inode %u points outside data region (block %u)", inode_index, blk);
+        return;
     }
-    struct inode *inodes = (struct inode *)inode_area;
+    if (t->nclaims == t->claims_cap) {
+        t->claims_cap = t->claims_cap ? t->claims_cap * 2 : 64;
+        t->claims = realloc(t->claims, t->claims_cap * sizeof(*t->claims));
+        if (!t->claims) {
+            die("realloc claims");
+        }
+    }
+    t->claims[t->nclaims].data_idx = blk - v->geo.data_start;
+    t->claims[t->nclaims].inode = inode_index;
+    t->nclaims++;
+}
 
-    uint8_t inode_used[inode_count];
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        inode_used[i] = (inodes[i].type != 0);
+// Claims the extent block and every block the extents map; returns how many
+// blocks they map.
+static uint32_t claim_extents(struct validation *v, struct task *t, uint32_t inode_index, const struct inode *ino) {
+    if (ino->extent_block != 0) {
+        claim_data_block(v, t, inode_index, ino->extent_block);
     }
-    uint32_t *link_refs = calloc(inode_count, sizeof(uint32_t));
-    if (!link_refs) {
-        die("calloc link refs");
+    uint64_t data_end = (uint64_t)v->geo.data_start + v->geo.data_blocks;
+    uint32_t nblocks = 0;
+    uint32_t i = 0;
+    const struct extent *e;
+    for (; (e = extent_at(ino, i)) != NULL && e->len != 0; ++i) {
+        if (e->start < v->geo.data_start || (uint64_t)e->start + e->len > data_end) {
+            report_error("inode %u extent %u (%u+%u) lies outside the data region", inode_index, i, e->start, e->len);
+            continue;
+        }
+        for (uint32_t b = 0; b < e->len; ++b) {
+            claim_data_block(v, t, inode_index, e->start + b);
+        }
+        nblocks += e->len;
     }
+    return nblocks;
+}
 
-    int data_owner[DATA_BLOCKS];
-    memset(data_owner, -1, sizeof(data_owner));
-    uint8_t data_blocks_referenced[DATA_BLOCKS];
-    memset(data_blocks_referenced, 0, sizeof(data_blocks_referenced));
+static void phase_inode_used(struct validation *v, struct worker *w, uint32_t index, struct task *t) {
+    (void)w;
+    (void)t;
+    uint32_t lo, hi;
+    task_range(index, INODES_PER_TASK, v->geo.inode_count, &lo, &hi);
+    for (uint32_t i = lo; i < hi; ++i) {
+        v->inode_used[i] = (v->inodes[i].type != 0);
+    }
+}
 
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        struct inode *ino = &inodes[i];
+static void phase_inodes(struct validation *v, struct worker *w, uint32_t index, struct task *t) {
+    uint32_t lo, hi;
+    task_range(index, INODES_PER_TASK, v->geo.inode_count, &lo, &hi);
+    for (uint32_t i = lo; i < hi; ++i) {
+        const struct inode *ino = &v->inodes[i];
         int allocated = ino->type != 0;
-        int bitmap_bit = bitmap_test(inode_bitmap, i);
+        int bitmap_bit = vsfs_bitmap_test(v->inode_bitmap, i);
         if (allocated != bitmap_bit) {
             report_error("inode %u allocation mismatch (inode vs bitmap)", i);
         }
-        inode_used[i] = allocated;
         if (!allocated) {
             continue;
         }
@@ -261,29 +572,35 @@ int main(int argc, char *argv[]) {
         }
 
         uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        if (required_blocks > DIRECT_POINTERS) {
-            report_error("inode %u size %u exceeds direct pointers", i, ino->size);
-        }
-
         uint32_t seen_blocks = 0;
-        for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
-            uint32_t blk = ino->direct[d];
-            if (blk == 0) {
-                continue;
+        if (ino->flags & ~INODE_FLAG_EXTENTS) {
+            report_error("inode %u has unknown flags 0x%x", i, ino->flags);
+        }
+        if (ino->flags & INODE_FLAG_EXTENTS) {
+            seen_blocks = claim_extents(v, t, i, ino);
+        } else {
+            if (required_blocks > DIRECT_POINTERS) {
+                report_error("inode %u size %u exceeds direct pointers", i, ino->size);
             }
-            seen_blocks++;
-            if (blk < DATA_START_IDX || blk >= DATA_START_IDX + DATA_BLOCKS) {
-                report_error("inode %u points outside data region (block %u)", i, blk);
-                continue;
+            for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+                uint32_t blk = ino->direct[d];
+                if (blk == 0) {
+                    continue;
+                }
+                seen_blocks++;
+                claim_data_block(v, t, i, blk);
             }
-            uint32_t data_idx = blk - DATA_START_IDX;
-            if (data_owner[data_idx] != -1 && data_owner[data_idx] != (int)i) {
-                report_error("data block %u referenced by both inode %d and inode %u", blk, data_owner[data_idx], i);
+        }
+        if (ino->index_block != 0) {
+            if (ino->type != 2) {
+                report_error("inode %u has a directory index but is not a directory", i);
             }
-            data_owner[data_idx] = (int)i;
-            data_blocks_referenced[data_idx] = 1;
+            claim_data_block(v, t, i, ino->index_block);
         }
 
+        if (ino->flags & INODE_FLAG_EXTENTS && seen_blocks > required_blocks) {
+            report_error("inode %u extents map %u blocks but its size needs %u", i, seen_blocks, required_blocks);
+        }
         if (seen_blocks < required_blocks) {
             report_error("inode %u lacks blocks for declared size (need %u have %u)", i, required_blocks, seen_blocks);
         }
@@ -292,42 +609,216 @@ int main(int argc, char *argv[]) {
         }
 
         if (ino->type == 2) {
-            check_directory(fd, ino, i, inode_used, inode_count, link_refs);
+            int index_in_range = ino->index_block >= v->geo.data_start &&
+                                 ino->index_block < v->geo.data_start + v->geo.data_blocks;
+            check_directory(ino, i, v->inode_used, v->geo.inode_count, w->link_refs, index_in_range);
         }
     }
+}
 
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        if (!inode_used[i]) {
+static void phase_links(struct validation *v, struct worker *w, uint32_t index, struct task *t) {
+    (void)w;
+    (void)t;
+    uint32_t lo, hi;
+    task_range(index, INODES_PER_TASK, v->geo.inode_count, &lo, &hi);
+    for (uint32_t i = lo; i < hi; ++i) {
+        if (!v->inode_used[i]) {
             continue;
         }
-        if (inodes[i].links != link_refs[i]) {
-            report_error("inode %u link count %u disagrees with directory refs %u", i, inodes[i].links, link_refs[i]);
+        uint32_t refs = 0;
+        for (unsigned k = 0; k < v->nthreads; ++k) {
+            refs += v->workers[k].link_refs[i];
+        }
+        if (v->inodes[i].links != refs) {
+            report_error("inode %u link count %u disagrees with directory refs %u", i, v->inodes[i].links, refs);
         }
     }
 
-    for (uint32_t bit = 0; bit < inode_count; ++bit) {
-        int bit_val = bitmap_test(inode_bitmap, bit);
-        if (bit_val && !inode_used[bit]) {
+    for (uint32_t bit = bitmap_next_mismatch(v->inode_bitmap, v->inode_used, lo, hi); bit < hi;
+         bit = bitmap_next_mismatch(v->inode_bitmap, v->inode_used, bit + 1U, hi)) {
+        if (!v->inode_used[bit]) {
             report_error("inode bitmap marks %u used but inode is free", bit);
-        }
-        if (!bit_val && inode_used[bit]) {
+        } else {
             report_error("inode bitmap misses allocated inode %u", bit);
         }
     }
-    bitmap_check_zero_tail(inode_bitmap, inode_count, "inode");
+}
 
-    for (uint32_t bit = 0; bit < DATA_BLOCKS; ++bit) {
-        int bit_val = bitmap_test(data_bitmap, bit);
-        if (bit_val && !data_blocks_referenced[bit]) {
-            report_error("data bitmap marks block %u used but no inode references it", bit + DATA_START_IDX);
+static void phase_data_bitmap(struct validation *v, struct worker *w, uint32_t index, struct task *t) {
+    (void)w;
+    (void)t;
+    uint32_t lo, hi;
+    task_range(index, BITS_PER_TASK, v->geo.data_blocks, &lo, &hi);
+    const uint8_t *referenced = v->data_blocks_referenced;
+    for (uint32_t bit = bitmap_next_mismatch(v->data_bitmap, referenced, lo, hi); bit < hi;
+         bit = bitmap_next_mismatch(v->data_bitmap, referenced, bit + 1U, hi)) {
+        if (!referenced[bit]) {
+            report_error("data bitmap marks block %u used but no inode references it", bit + v->geo.data_start);
+        } else {
+            report_error("data block %u referenced but bitmap is clear", bit + v->geo.data_start);
         }
-        if (!bit_val && data_blocks_referenced[bit]) {
-            report_error("data block %u referenced but bitmap is clear", bit + DATA_START_IDX);
+    }
+}
+
+// Applies the claims in inode order, as a serial walk would have seen them.
+static void merge_claims(struct validation *v, const struct task *tasks, uint32_t ntasks) {
+    for (uint32_t i = 0; i < ntasks; ++i) {
+        for (size_t c = 0; c < tasks[i].nclaims; ++c) {
+            uint32_t data_idx = tasks[i].claims[c].data_idx;
+            uint32_t inode_index = tasks[i].claims[c].inode;
+            int owner = v->data_owner[data_idx];
+            if (owner != -1 && owner != (int)inode_index) {
+                report_error("data block %u referenced by both inode %d and inode %u",
+                             data_idx + v->geo.data_start, owner, inode_index);
+            }
+            v->data_owner[data_idx] = (int)inode_index;
+            v->data_blocks_referenced[data_idx] = 1;
         }
     }
+}
 
-    bitmap_check_zero_tail(data_bitmap, DATA_BLOCKS, "data");
+static void usage(void) {
+    fprintf(stderr, "Usage: ./validator [--threads=N] [--with-journal] [image]\n");
+    fprintf(stderr, "  --with-journal  check the state the committed journal would install, without installing it\n");
+    exit(EXIT_FAILURE);
+}
 
+static unsigned parse_threads(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || v == 0) {
+        usage();
+    }
+    return v > MAX_THREADS ? MAX_THREADS : (unsigned)v;
+}
+
+int main(int argc, char *argv[]) {
+    const char *image_path = DEFAULT_IMAGE;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = online > 0 ? (unsigned)online : 1U;
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+
+    int have_path = 0;
+    int with_journal = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            nthreads = parse_threads(argv[i] + 10);
+        } else if (strcmp(argv[i], "--with-journal") == 0) {
+            with_journal = 1;
+        } else if (argv[i][0] == '-' || have_path) {
+            usage();
+        } else {
+            image_path = argv[i];
+            have_path = 1;
+        }
+    }
+
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        die("open");
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        die("fstat");
+    }
+    if (st.st_size < (off_t)BLOCK_SIZE) {
+        report_error("image is smaller than one block");
+        fprintf(stderr, "%d inconsistencies found.\n", error_count);
+        return 1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        die("mmap");
+    }
+    image_base = map;
+    image_blocks = (uint32_t)((uint64_t)st.st_size / BLOCK_SIZE);
+
+    struct superblock sb;
+    memcpy(&sb, block_at(SB_BLOCK_NO), sizeof(sb));
+    struct validation v;
+    memset(&v, 0, sizeof(v));
+    if (validate_superblock(&sb, &v.geo) != 0) {
+        fprintf(stderr, "%d inconsistencies found.\n", error_count);
+        return 1;
+    }
+    const struct vsfs_geometry *geo = &v.geo;
+    if (image_blocks < geo->total_blocks) {
+        report_error("image holds %u blocks but the superblock declares %u", image_blocks, geo->total_blocks);
+        fprintf(stderr, "%d inconsistencies found.\n", error_count);
+        return 1;
+    }
+
+    if (with_journal) {
+        uint32_t cap = 0;
+        int n = vsfs_journal_overlay(image_path, overlay_add, &cap);
+        if (n < 0) {
+            report_error("journal could not be replayed; the base image alone is not the post-replay state");
+            fprintf(stderr, "%d inconsistencies found.\n", error_count);
+            return 1;
+        }
+        qsort(overlay, overlay_count, sizeof(*overlay), overlay_cmp);
+        for (uint32_t i = 0; i < overlay_count; ++i) {
+            if (overlay[i].block_no >= geo->total_blocks || overlay[i].block_no < geo->inode_bmap_start) {
+                report_error("journal logs block %u outside the metadata and data regions", overlay[i].block_no);
+            }
+        }
+        printf("Applying %u committed journal blocks.\n", overlay_count);
+    }
+
+    v.inode_bitmap = region_at(geo->inode_bmap_start, geo->inode_bmap_blocks);
+    v.data_bitmap = region_at(geo->data_bmap_start, geo->data_bmap_blocks);
+    v.inodes = (const struct inode *)region_at(geo->inode_start, geo->inode_blocks);
+
+    uint32_t inode_count = geo->inode_count;
+    uint32_t inode_slots = geo->inode_blocks * INODES_PER_BLOCK;
+    for (uint32_t i = inode_count; i < inode_slots; ++i) {
+        if (v.inodes[i].type != 0) {
+            report_error("inode slot %u beyond inode count %u is in use", i, inode_count);
+        }
+    }
+
+    v.inode_used = malloc(inode_count);
+    v.data_owner = malloc((size_t)geo->data_blocks * sizeof(int));
+    v.data_blocks_referenced = calloc(geo->data_blocks, 1);
+    if (!v.inode_used || !v.data_owner || !v.data_blocks_referenced) {
+        die("malloc validation state");
+    }
+    memset(v.data_owner, -1, (size_t)geo->data_blocks * sizeof(int));
+
+    uint32_t inode_tasks = vsfs_div_round_up(inode_count, INODES_PER_TASK);
+    uint32_t data_tasks = vsfs_div_round_up(geo->data_blocks, BITS_PER_TASK);
+    uint32_t max_tasks = inode_tasks > data_tasks ? inode_tasks : data_tasks;
+    if (nthreads > max_tasks) {
+        nthreads = max_tasks;
+    }
+
+    v.nthreads = nthreads;
+    for (unsigned t = 0; t < nthreads; ++t) {
+        v.workers[t].v = &v;
+        v.workers[t].link_refs = calloc(inode_count, sizeof(uint32_t));
+        if (!v.workers[t].link_refs) {
+            die("calloc link refs");
+        }
+    }
+
+    free_tasks(run_phase(&v, phase_inode_used, inode_tasks), inode_tasks);
+
+    struct task *tasks = run_phase(&v, phase_inodes, inode_tasks);
+    merge_claims(&v, tasks, inode_tasks);
+    free_tasks(tasks, inode_tasks);
+
+    free_tasks(run_phase(&v, phase_links, inode_tasks), inode_tasks);
+    bitmap_check_zero_tail(v.inode_bitmap, geo->inode_bmap_blocks * BITS_PER_BLOCK, inode_count, "inode");
+
+    free_tasks(run_phase(&v, phase_data_bitmap, data_tasks), data_tasks);
+    bitmap_check_zero_tail(v.data_bitmap, geo->data_bmap_blocks * BITS_PER_BLOCK, geo->data_blocks, "data");
+
+    if (munmap(map, (size_t)st.st_size) < 0) {
+        die("munmap");
+    }
     if (close(fd) < 0) {
         die("close");
     }
@@ -0,0 +1,1958 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "uring.h"
+#include "vsfs.h"
+#include "vsfs_format.h"
+#include "vsfs_bitmap.h"
+#include "vsfs_crc32c.h"
+
+
+// The journal is a circular log. The header names the oldest transaction
+// that still has to be installed (head) and where the next one goes
+// (tail); install only moves head, so the region is zeroed once when the
+// journal is first initialised and never again. Every record carries the
+// sequence number of its transaction and a CRC32C, so records left over
+// from an earlier lap, or torn by a crash, end the scan; a transaction whose
+// commit record is never reached is not replayed.
+#define JOURNAL_MAGIC     0x4A524E33U
+#define JOURNAL_MAGIC_OLD 0x4A524E4CU    // original format: {magic, bytes used}, records from byte 8
+#define REC_DATA      1U
+#define REC_COMMIT    2U
+#define REC_WRAP      3U    // rest of the region is unused, continue at the start
+#define REC_DELTA     4U    // bytes [offset, offset + length) of one block
+
+struct journal_header 
+{
+    uint32_t magic;
+    uint32_t head;        // byte offset (in the journal) of the oldest live transaction
+    uint32_t tail;        // byte offset where the next transaction is written
+    uint32_t head_seq;    // sequence number of the transaction at head
+    uint32_t tail_seq;    // sequence number the next transaction gets
+    uint32_t _reserved;
+};
+
+struct rec_header 
+{
+    uint16_t type;
+    uint16_t size;
+    uint32_t seq;
+    uint32_t checksum;    // over the whole record, computed with this field zero
+};
+
+struct delta_header
+{
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;
+};
+
+_Static_assert(sizeof(struct journal_header) == 24, "journal_header must be 24 bytes");
+_Static_assert(sizeof(struct rec_header) == 12, "rec_header must be 12 bytes");
+_Static_assert(sizeof(struct delta_header) == 8, "delta_header must be 8 bytes");
+
+#define JOURNAL_LOG_START ((uint32_t)sizeof(struct journal_header))
+
+
+static void die(const char *msg) 
+{
+    perror(msg);
+    exit(1);
+}
+
+static void pread_exact(int fd, void *buf, size_t n, off_t off) 
+{
+    ssize_t r = pread(fd, buf, n, off);
+    if (r != (ssize_t)n) die("pread");
+}
+
+static void pwrite_exact(int fd, const void *buf, size_t n, off_t off) 
+{
+    ssize_t r = pwrite(fd, buf, n, off);
+    if (r != (ssize_t)n) die("pwrite");
+}
+
+static void read_block(int fd, uint32_t blk, void *buf4096) 
+{
+    pread_exact(fd, buf4096, BLOCK_SIZE, (off_t)blk * (off_t)BLOCK_SIZE);
+}
+
+static void write_block(int fd, uint32_t blk, const void *buf4096) 
+{
+    pwrite_exact(fd, buf4096, BLOCK_SIZE, (off_t)blk * (off_t)BLOCK_SIZE);
+}
+
+static int open_image_rw(const char *path) 
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) die("open");
+    return fd;
+}
+
+// Block number -> latest logged image. Open addressing over a power-of-two
+// bucket array. Full-block records leave their image in the journal
+// mapping; a block that a delta record patches gets its own copy.
+struct image_map
+{
+    uint32_t *keys;            // block_no + 1, 0 marks an empty bucket
+    uint32_t *slots;           // index into blocks / images
+    uint32_t nbuckets;
+
+    uint32_t *blocks;          // in first-insert order
+    const uint8_t **images;
+    uint8_t **owned;           // images[i] when it is a private copy, else NULL
+    uint32_t count;
+    uint32_t cap;
+};
+
+static void image_map_init(struct image_map *m)
+{
+    memset(m, 0, sizeof(*m));
+}
+
+static void image_map_clear(struct image_map *m)
+{
+    if (m->keys) memset(m->keys, 0, m->nbuckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < m->count; i++) free(m->owned[i]);
+    m->count = 0;
+}
+
+static void image_map_free(struct image_map *m)
+{
+    image_map_clear(m);
+    free(m->keys);
+    free(m->slots);
+    free(m->blocks);
+    free(m->images);
+    free(m->owned);
+    image_map_init(m);
+}
+
+static uint32_t image_map_bucket(const struct image_map *m, uint32_t block_no)
+{
+    return (block_no * 2654435761U) & (m->nbuckets - 1U);
+}
+
+static void image_map_rehash(struct image_map *m, uint32_t nbuckets)
+{
+    free(m->keys);
+    free(m->slots);
+    m->keys = calloc(nbuckets, sizeof(uint32_t));
+    m->slots = malloc(nbuckets * sizeof(uint32_t));
+    if (!m->keys || !m->slots) die("malloc image map");
+    m->nbuckets = nbuckets;
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        uint32_t b = image_map_bucket(m, m->blocks[i]);
+        while (m->keys[b] != 0) b = (b + 1U) & (nbuckets - 1U);
+        m->keys[b] = m->blocks[i] + 1U;
+        m->slots[b] = i;
+    }
+}
+
+// Index of block_no in blocks/images, or -1.
+static int64_t image_map_index(const struct image_map *m, uint32_t block_no)
+{
+    if (m->count == 0) return -1;
+    uint32_t b = image_map_bucket(m, block_no);
+    while (m->keys[b] != 0) {
+        if (m->keys[b] == block_no + 1U) return m->slots[b];
+        b = (b + 1U) & (m->nbuckets - 1U);
+    }
+    return -1;
+}
+
+static const uint8_t *image_map_find(const struct image_map *m, uint32_t block_no)
+{
+    int64_t i = image_map_index(m, block_no);
+    return i < 0 ? NULL : m->images[i];
+}
+
+static uint32_t image_map_insert(struct image_map *m, uint32_t block_no)
+{
+    if (2U * (m->count + 1U) > m->nbuckets) {
+        image_map_rehash(m, m->nbuckets ? 2U * m->nbuckets : 16U);
+    }
+    if (m->count == m->cap) {
+        uint32_t cap = m->cap ? 2U * m->cap : 8U;
+        uint32_t *blocks = realloc(m->blocks, cap * sizeof(uint32_t));
+        if (!blocks) die("realloc image map");
+        m->blocks = blocks;
+        const uint8_t **images = realloc(m->images, cap * sizeof(const uint8_t *));
+        if (!images) die("realloc image map");
+        m->images = images;
+        uint8_t **owned = realloc(m->owned, cap * sizeof(uint8_t *));
+        if (!owned) die("realloc image map");
+        m->owned = owned;
+        m->cap = cap;
+    }
+
+    uint32_t b = image_map_bucket(m, block_no);
+    while (m->keys[b] != 0) b = (b + 1U) & (m->nbuckets - 1U);
+    m->keys[b] = block_no + 1U;
+    m->slots[b] = m->count;
+    m->blocks[m->count] = block_no;
+    m->images[m->count] = NULL;
+    m->owned[m->count] = NULL;
+    return m->count++;
+}
+
+static void image_map_upsert(struct image_map *m, uint32_t block_no, const uint8_t *image)
+{
+    int64_t i = image_map_index(m, block_no);
+    if (i < 0) i = image_map_insert(m, block_no);
+    free(m->owned[i]);
+    m->owned[i] = NULL;
+    m->images[i] = image;
+}
+
+// Returns a private, writable copy of block_no's image, made from the image
+// already in the map or, if the block is not in the map, from disk.
+static uint8_t *image_map_owned(struct image_map *m, int fd, uint32_t block_no)
+{
+    int64_t i = image_map_index(m, block_no);
+    if (i < 0) i = image_map_insert(m, block_no);
+
+    if (!m->owned[i]) {
+        uint8_t *copy = malloc(BLOCK_SIZE);
+        if (!copy) die("malloc image copy");
+        if (m->images[i]) memcpy(copy, m->images[i], BLOCK_SIZE);
+        else read_block(fd, block_no, copy);
+        m->owned[i] = copy;
+        m->images[i] = copy;
+    }
+    return m->owned[i];
+}
+
+// Patches bytes [off, off + len) of block_no. The base is the latest image
+// already in the map, or the on-disk block if the block has not been logged.
+static void image_map_patch(struct image_map *m, int fd, uint32_t block_no,
+                            uint32_t off, uint32_t len, const uint8_t *bytes)
+{
+    memcpy(image_map_owned(m, fd, block_no) + off, bytes, len);
+}
+
+// One caller of vsfs_create_many waiting for its names to be committed.
+struct group_req
+{
+    const char *const *names;
+    unsigned nnames;
+    int rc;                   // 1 until the leader has decided it
+    int done;
+    struct group_req *next;
+};
+
+struct vsfs
+{
+    int fd;
+    struct vsfs_geometry geo;
+    enum vsfs_sync sync;
+    struct journal_header jh;
+    int journal_ready;        // 0 until the journal region has been initialised
+    unsigned checkpoint_pct;  // auto-install once the journal is this full, 0 = never
+
+    struct uring *ring;       // NULL: synchronous pwrite/fdatasync
+    struct bcache *cache;     // metadata as of the journal tail; dirty until installed
+    struct image_map work;    // private copies edited by the transaction being built
+    uint32_t log_end;         // just past the last intact commit; a torn tail
+    uint32_t log_end_seq;     // beyond it is dropped by the next commit or install
+    uint32_t inode_hint;      // allocation searches resume here
+    uint32_t data_hint;
+
+    // Group commit: callers queue their requests, and whichever thread finds
+    // no commit in progress becomes the leader and logs everything queued so
+    // far as one transaction. Other processes are kept out with flock.
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    struct group_req *queue;
+    struct group_req **queue_tail;
+    int busy;                 // a leader or an install owns the journal
+    unsigned window_us;
+    uint64_t commits;
+    uint64_t commit_requests;
+    uint64_t journal_bytes;
+    uint64_t data_bytes;
+    uint64_t syscalls;        // besides the cache's and the ring's own
+};
+
+static void barrier(int fd)
+{
+    if (fdatasync(fd) != 0) die("fdatasync");
+}
+
+#define URING_ENTRIES 64U
+
+// Commit and install write through these, so that with io_uring the whole
+// sequence goes to the kernel in one submission: every write and barrier is
+// linked to the next one, which keeps the on-disk order of the synchronous
+// path. The buffers must stay valid until io_flush.
+static void io_write(struct vsfs *fs, const void *buf, uint32_t len, off_t off)
+{
+    fs->journal_bytes += len;
+    if (!fs->ring) {
+        pwrite_exact(fs->fd, buf, len, off);
+        fs->syscalls++;
+        return;
+    }
+    uring_write(fs->ring, fs->fd, buf, len, off, fs->sync == VSFS_SYNC_NONE ? 0U : URING_LINK);
+}
+
+static void io_barrier(struct vsfs *fs)
+{
+    if (!fs->ring) {
+        barrier(fs->fd);
+        fs->syscalls++;
+        return;
+    }
+    uring_fdatasync(fs->ring, fs->fd, URING_LINK);
+}
+
+static void io_flush(struct vsfs *fs)
+{
+    if (fs->ring) uring_run(fs->ring);
+}
+
+static off_t journal_base_off(const struct vsfs_geometry *g) 
+{
+    return (off_t)g->journal_start * (off_t)BLOCK_SIZE;
+}
+
+static uint32_t journal_capacity_bytes(const struct vsfs_geometry *g) 
+{
+    return g->journal_blocks * BLOCK_SIZE;
+}
+
+static uint32_t journal_used_bytes(const struct vsfs_geometry *g, const struct journal_header *jh)
+{
+    if (jh->tail >= jh->head) return jh->tail - jh->head;
+    return (journal_capacity_bytes(g) - jh->head) + (jh->tail - JOURNAL_LOG_START);
+}
+
+static void journal_clear_region(int fd, const struct vsfs_geometry *g) 
+{
+    uint8_t zero[BLOCK_SIZE];
+    memset(zero, 0, sizeof(zero));
+    for (uint32_t i = 0; i < g->journal_blocks; i++) {
+        write_block(fd, g->journal_start + i, zero);
+    }
+}
+
+static void journal_read_header(int fd, const struct vsfs_geometry *g, struct journal_header *jh) 
+{
+    pread_exact(fd, jh, sizeof(*jh), journal_base_off(g));
+}
+
+static void journal_write_header(int fd, const struct vsfs_geometry *g, const struct journal_header *jh) 
+{
+    pwrite_exact(fd, jh, sizeof(*jh), journal_base_off(g));
+}
+
+static int journal_header_valid(const struct vsfs_geometry *g, const struct journal_header *jh)
+{
+    uint32_t end = journal_capacity_bytes(g);
+    return jh->magic == JOURNAL_MAGIC &&
+           jh->head >= JOURNAL_LOG_START && jh->head < end &&
+           jh->tail >= JOURNAL_LOG_START && jh->tail <= end;
+}
+
+static void journal_header_empty(struct journal_header *jh, uint32_t seq)
+{
+    memset(jh, 0, sizeof(*jh));
+    jh->magic = JOURNAL_MAGIC;
+    jh->head = JOURNAL_LOG_START;
+    jh->tail = JOURNAL_LOG_START;
+    jh->head_seq = seq;
+    jh->tail_seq = seq;
+}
+
+static void journal_init_if_needed(int fd, const struct vsfs_geometry *g, struct journal_header *jh) 
+{
+    journal_read_header(fd, g, jh);
+    if (!journal_header_valid(g, jh)) {
+
+        struct journal_header fresh;
+        
+        journal_clear_region(fd, g);
+        journal_header_empty(&fresh, 1U);
+        journal_write_header(fd, g, &fresh);
+        *jh = fresh;
+    }
+}
+
+// An original-format journal is replaced on the first commit, which is only
+// safe while it is empty. One that still holds records has to be installed
+// by the tool that wrote it. Returns -1 with a message in that case.
+static int journal_check_old(const struct journal_header *jh)
+{
+    // the old bytes-used count sits where head is now; 8 is an empty log
+    if (jh->magic == JOURNAL_MAGIC_OLD && jh->head > 2 * sizeof(uint32_t)) {
+        fprintf(stderr, "vsfs: journal holds uninstalled records in the old format; "
+                        "install them with the old ./journal first\n");
+        return -1;
+    }
+    return 0;
+}
+
+// CRC32C of a record with its checksum field taken as zero.
+static uint32_t record_checksum(const uint8_t *rec, uint32_t size)
+{
+    struct rec_header rh;
+    memcpy(&rh, rec, sizeof(rh));
+    rh.checksum = 0;
+
+    uint32_t crc = vsfs_crc32c_update(~0U, &rh, sizeof(rh));
+    return ~vsfs_crc32c_update(crc, rec + sizeof(rh), size - (uint32_t)sizeof(rh));
+}
+
+// Decides where a transaction of n bytes is written. Transactions are never
+// split: if the space up to the end of the region is too small the log
+// wraps to the start. Returns 0 if the transaction does not fit at all.
+static int journal_place(const struct vsfs_geometry *g, const struct journal_header *jh,
+                         uint32_t n, uint32_t *off, int *wrap)
+{
+    uint32_t end = journal_capacity_bytes(g);
+    *wrap = 0;
+
+    if (jh->head == jh->tail) {
+        // empty: head moves along with the new transaction, no marker needed
+        *off = (jh->tail + n <= end) ? jh->tail : JOURNAL_LOG_START;
+        return *off + n <= end;
+    }
+    if (jh->tail > jh->head) {
+        if (jh->tail + n <= end) {
+            *off = jh->tail;
+            return 1;
+        }
+        *off = JOURNAL_LOG_START;
+        *wrap = 1;
+        return JOURNAL_LOG_START + n < jh->head;
+    }
+    *off = jh->tail;
+    return jh->tail + n < jh->head;
+}
+
+// A transaction is assembled in memory (data records followed by the commit
+// record) and written to the log with one pwrite. The header is rewritten
+// once afterwards; that write is the commit point. A crash between the two
+// leaves tail at the old value, so the half-written transaction is never
+// scanned.
+struct txn
+{
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t cap;
+};
+
+static void txn_begin(struct txn *t)
+{
+    t->buf = NULL;
+    t->len = 0;
+    t->cap = 0;
+}
+
+static void txn_free(struct txn *t)
+{
+    free(t->buf);
+    txn_begin(t);
+}
+
+static void txn_append_bytes(struct txn *t, const void *src, uint32_t n)
+{
+    if (t->len + n > t->cap) {
+        uint32_t cap = t->cap ? t->cap : 4U * BLOCK_SIZE;
+        while (cap < t->len + n) cap *= 2U;
+        uint8_t *nb = realloc(t->buf, cap);
+        if (!nb) die("realloc txn");
+        t->buf = nb;
+        t->cap = cap;
+    }
+    memcpy(t->buf + t->len, src, n);
+    t->len += n;
+}
+
+static void rec_header_init(struct rec_header *rh, uint16_t type, uint32_t size)
+{
+    memset(rh, 0, sizeof(*rh));
+    rh->type = type;
+    rh->size = (uint16_t)size;
+}
+
+static void txn_add_data(struct txn *t, uint32_t block_no, const uint8_t image[BLOCK_SIZE])
+{
+    struct rec_header rh;
+    rec_header_init(&rh, REC_DATA, sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE);
+
+    txn_append_bytes(t, &rh, sizeof(rh));
+    txn_append_bytes(t, &block_no, sizeof(block_no));
+    txn_append_bytes(t, image, BLOCK_SIZE);
+}
+
+static void txn_add_delta(struct txn *t, uint32_t block_no, uint32_t off, uint32_t len,
+                          const uint8_t *bytes)
+{
+    struct rec_header rh;
+    struct delta_header dh;
+    rec_header_init(&rh, REC_DELTA, sizeof(rh) + sizeof(dh) + len);
+    dh.block_no = block_no;
+    dh.offset = (uint16_t)off;
+    dh.length = (uint16_t)len;
+
+    txn_append_bytes(t, &rh, sizeof(rh));
+    txn_append_bytes(t, &dh, sizeof(dh));
+    txn_append_bytes(t, bytes, len);
+}
+
+// Logs the difference between two versions of a block as delta records.
+// Changed runs closer together than a record header are merged; if the
+// deltas would not be smaller than a full image, the full image is logged.
+static void txn_add_changes(struct txn *t, uint32_t block_no,
+                            const uint8_t *old, const uint8_t *cur)
+{
+    const uint32_t overhead = (uint32_t)(sizeof(struct rec_header) + sizeof(struct delta_header));
+    uint32_t runs[BLOCK_SIZE / 16U][2];   // runs are > overhead bytes apart
+    uint32_t nruns = 0;
+    uint32_t bytes = 0;
+
+    uint32_t i = 0;
+    while (i < BLOCK_SIZE) {
+        if (old[i] == cur[i]) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        uint32_t last = i;
+        for (i++; i < BLOCK_SIZE && i - last <= overhead; i++) {
+            if (old[i] != cur[i]) last = i;
+        }
+        runs[nruns][0] = start;
+        runs[nruns][1] = last + 1U - start;
+        bytes += overhead + runs[nruns][1];
+        nruns++;
+        i = last + 1U;
+    }
+
+    if (nruns == 0) return;
+    if (bytes >= (uint32_t)sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE) {
+        txn_add_data(t, block_no, cur);
+        return;
+    }
+    for (uint32_t r = 0; r < nruns; r++) {
+        txn_add_delta(t, block_no, runs[r][0], runs[r][1], cur + runs[r][0]);
+    }
+}
+
+static uint32_t txn_commit_bytes(const struct txn *t)
+{
+    return t->len + (uint32_t)sizeof(struct rec_header);
+}
+
+static int txn_fits(const struct vsfs_geometry *g, const struct journal_header *jh,
+                    const struct txn *t)
+{
+    uint32_t off;
+    int wrap;
+    return journal_place(g, jh, txn_commit_bytes(t), &off, &wrap);
+}
+
+static void record_seal(uint8_t *rec, uint32_t seq)
+{
+    struct rec_header rh;
+    memcpy(&rh, rec, sizeof(rh));
+    rh.seq = seq;
+    memcpy(rec, &rh, sizeof(rh));
+    rh.checksum = record_checksum(rec, rh.size);
+    memcpy(rec, &rh, sizeof(rh));
+}
+
+// Stamps every record of the transaction with its sequence number and checksum.
+static void txn_seal(struct txn *t, uint32_t seq)
+{
+    uint32_t pos = 0;
+    while (pos < t->len) {
+        struct rec_header rh;
+        memcpy(&rh, t->buf + pos, sizeof(rh));
+        record_seal(t->buf + pos, seq);
+        pos += rh.size;
+    }
+}
+
+static int journal_install(struct vsfs *fs);
+
+static int journal_commit_txn(struct vsfs *fs, struct txn *t)
+{
+    if (!fs->journal_ready) {
+        journal_init_if_needed(fs->fd, &fs->geo, &fs->jh);
+        fs->journal_ready = 1;
+        fs->log_end = fs->jh.tail;
+        fs->log_end_seq = fs->jh.tail_seq;
+    }
+    if (fs->log_end_seq != fs->jh.tail_seq && journal_install(fs) < 0) return -1;
+
+    uint32_t off;
+    int wrap;
+    if (!journal_place(&fs->geo, &fs->jh, txn_commit_bytes(t), &off, &wrap)) {
+        fprintf(stderr, "ERROR: journal full. Run ./journal install\n");
+        return -1;
+    }
+
+    struct rec_header rh;
+    rec_header_init(&rh, REC_COMMIT, sizeof(rh));
+    txn_append_bytes(t, &rh, sizeof(rh));
+
+    uint32_t seq = fs->jh.tail_seq;
+    txn_seal(t, seq);
+
+    uint8_t marker[sizeof(struct rec_header)];
+    if (wrap && fs->jh.tail + sizeof(rh) <= journal_capacity_bytes(&fs->geo)) {
+        rec_header_init(&rh, REC_WRAP, sizeof(rh));
+        memcpy(marker, &rh, sizeof(rh));
+        record_seal(marker, seq);
+        io_write(fs, marker, sizeof(marker), journal_base_off(&fs->geo) + (off_t)fs->jh.tail);
+    }
+
+    off_t pos = journal_base_off(&fs->geo) + (off_t)off;
+    if (fs->sync == VSFS_SYNC_ORDERED) {
+        uint32_t body = t->len - (uint32_t)sizeof(rh);
+        io_write(fs, t->buf, body, pos);
+        io_barrier(fs);
+        io_write(fs, t->buf + body, sizeof(rh), pos + (off_t)body);
+    } else {
+        io_write(fs, t->buf, t->len, pos);
+    }
+
+    if (fs->jh.head == fs->jh.tail) fs->jh.head = off;
+    fs->jh.tail = off + t->len;
+    fs->jh.tail_seq = seq + 1U;
+    fs->log_end = fs->jh.tail;
+    fs->log_end_seq = fs->jh.tail_seq;
+    io_write(fs, &fs->jh, sizeof(fs->jh), journal_base_off(&fs->geo));
+    if (fs->sync != VSFS_SYNC_NONE) io_barrier(fs);
+    io_flush(fs);
+    return 0;
+}
+
+// Read-only mapping of the superblock and journal blocks. Replay and
+// install walk records in place and hand out pointers into the mapping
+// instead of copying images out with pread.
+struct journal_map
+{
+    uint8_t *base;
+    size_t len;
+    const uint8_t *log;   // start of the journal region (the journal header)
+    uint32_t capacity;    // journal size in bytes
+};
+
+static void journal_map_open(int fd, const struct vsfs_geometry *g, struct journal_map *jm)
+{
+    jm->len = (size_t)(g->journal_start + g->journal_blocks) * BLOCK_SIZE;
+    void *p = mmap(NULL, jm->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) die("mmap");
+    jm->base = p;
+    jm->log = jm->base + journal_base_off(g);
+    jm->capacity = journal_capacity_bytes(g);
+}
+
+static void journal_map_close(struct journal_map *jm)
+{
+    if (munmap(jm->base, jm->len) != 0) die("munmap");
+    jm->base = NULL;
+    jm->log = NULL;
+}
+
+struct journal_record
+{
+    uint16_t type;
+    uint32_t block_no;        // REC_DATA / REC_DELTA
+    uint32_t offset;          // REC_DELTA: byte range inside the block
+    uint32_t length;
+    const uint8_t *image;     // REC_DATA: the block, REC_DELTA: the range; points into the mapping
+};
+
+struct journal_iter
+{
+    const uint8_t *log;
+    uint32_t end;
+    uint32_t pos;
+    uint32_t tail;
+    uint32_t seq;         // sequence number expected for the current transaction
+    int wrapped;
+};
+
+static void journal_iter_init(struct journal_iter *it, const struct journal_map *jm,
+                              const struct journal_header *jh)
+{
+    it->log = jm->log;
+    it->end = jm->capacity;
+    it->pos = jh->head;
+    it->tail = jh->tail;
+    it->seq = jh->head_seq;
+    it->wrapped = 0;
+}
+
+static int journal_iter_wrap(struct journal_iter *it)
+{
+    if (it->wrapped) return 0;
+    it->wrapped = 1;
+    it->pos = JOURNAL_LOG_START;
+    return 1;
+}
+
+// Returns 1 and fills rec for the next well-formed record, 0 at the tail
+// or at the first record that fails validation.
+static int journal_next_record(struct journal_iter *it, struct journal_record *rec)
+{
+    uint32_t end = it->end;
+
+    for (;;) {
+        if (it->pos == it->tail) return 0;
+        if (it->pos + sizeof(struct rec_header) > end) {
+            if (!journal_iter_wrap(it)) return 0;
+            continue;
+        }
+
+        struct rec_header rh;
+        memcpy(&rh, it->log + it->pos, sizeof(rh));
+
+        if (rh.seq != it->seq) return 0;
+        if (rh.size < sizeof(struct rec_header)) return 0;
+        if (it->pos + rh.size > end) return 0;
+        if (record_checksum(it->log + it->pos, rh.size) != rh.checksum) return 0;
+
+        if (rh.type == REC_WRAP) {
+            if (rh.size != sizeof(struct rec_header) || !journal_iter_wrap(it)) return 0;
+            continue;
+        } else if (rh.type == REC_DATA) {
+            uint32_t need = (uint32_t)(sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE);
+            if (rh.size != need) return 0;
+            memcpy(&rec->block_no, it->log + it->pos + sizeof(rh), sizeof(uint32_t));
+            rec->image = it->log + it->pos + sizeof(rh) + sizeof(uint32_t);
+        } else if (rh.type == REC_DELTA) {
+            struct delta_header dh;
+            if (rh.size < sizeof(rh) + sizeof(dh)) return 0;
+            memcpy(&dh, it->log + it->pos + sizeof(rh), sizeof(dh));
+            if (rh.size != sizeof(rh) + sizeof(dh) + dh.length) return 0;
+            if ((uint32_t)dh.offset + dh.length > BLOCK_SIZE) return 0;
+            rec->block_no = dh.block_no;
+            rec->offset = dh.offset;
+            rec->length = dh.length;
+            rec->image = it->log + it->pos + sizeof(rh) + sizeof(dh);
+        } else if (rh.type == REC_COMMIT) {
+            if (rh.size != sizeof(struct rec_header)) return 0;
+            it->seq++;
+        } else {
+            return 0;
+        }
+
+        rec->type = rh.type;
+        it->pos += rh.size;
+        return 1;
+    }
+}
+
+// Fills latest with the newest committed image of every logged block.
+// Image pointers stay valid until jm is closed and latest is freed.
+// A transaction is applied only once its commit record has been read, by
+// walking its records a second time from a saved iterator.
+// If end is not NULL it is left just past the last intact commit record.
+static void journal_collect_latest_committed(int fd,
+                                            const struct journal_map *jm,
+                                            const struct journal_header *jh,
+                                            struct image_map *latest,
+                                            struct journal_iter *end) {
+    image_map_clear(latest);
+
+    struct journal_iter it, txn_start;
+    struct journal_record rec;
+    journal_iter_init(&it, jm, jh);
+    txn_start = it;
+
+    while (journal_next_record(&it, &rec)) {
+        if (rec.type != REC_COMMIT) continue;
+
+        while (journal_next_record(&txn_start, &rec) && rec.type != REC_COMMIT) {
+            if (rec.type == REC_DATA) {
+                image_map_upsert(latest, rec.block_no, rec.image);
+            } else {
+                image_map_patch(latest, fd, rec.block_no, rec.offset, rec.length, rec.image);
+            }
+        }
+        txn_start = it;
+    }
+    if (end) *end = txn_start;
+}
+
+// Committed view of a metadata block: on disk plus the journal.
+static const uint8_t *meta_cur(struct vsfs *fs, uint32_t block_no)
+{
+    return bcache_read(fs->cache, block_no);
+}
+
+// View of a block inside the transaction being built.
+static const uint8_t *meta_read(struct vsfs *fs, uint32_t block_no)
+{
+    const uint8_t *img = image_map_find(&fs->work, block_no);
+    return img ? img : meta_cur(fs, block_no);
+}
+
+static uint8_t *meta_write(struct vsfs *fs, uint32_t block_no)
+{
+    if (image_map_index(&fs->work, block_no) < 0) {
+        image_map_upsert(&fs->work, block_no, meta_cur(fs, block_no));
+    }
+    return image_map_owned(&fs->work, fs->fd, block_no);
+}
+
+static void inode_bitmap_set(struct vsfs *fs, uint32_t inum)
+{
+    uint8_t *bm = meta_write(fs, fs->geo.inode_bmap_start + inum / BITS_PER_BLOCK);
+    vsfs_bitmap_set(bm, inum % BITS_PER_BLOCK);
+}
+
+static const struct inode *inode_read(struct vsfs *fs, uint32_t inum)
+{
+    const uint8_t *blk = meta_read(fs, fs->geo.inode_start + inum / INODES_PER_BLOCK);
+    return (const struct inode *)blk + inum % INODES_PER_BLOCK;
+}
+
+static struct inode *inode_write(struct vsfs *fs, uint32_t inum)
+{
+    uint8_t *blk = meta_write(fs, fs->geo.inode_start + inum / INODES_PER_BLOCK);
+    return (struct inode *)blk + inum % INODES_PER_BLOCK;
+}
+
+// First bit equal to value in [from, nbits) of a bitmap spread over
+// consecutive blocks, read through the transaction; nbits if there is none.
+static uint32_t bitmap_find(struct vsfs *fs, uint32_t start_blk, uint32_t from, uint32_t nbits, int value)
+{
+    while (from < nbits) {
+        uint32_t base = from - from % BITS_PER_BLOCK;
+        uint32_t bits = nbits - base < BITS_PER_BLOCK ? nbits - base : BITS_PER_BLOCK;
+        uint32_t bit = vsfs_bitmap_find(meta_read(fs, start_blk + base / BITS_PER_BLOCK),
+                                        from - base, bits, value);
+        if (bit < bits) return base + bit;
+        from = base + bits;
+    }
+    return nbits;
+}
+
+static uint32_t bitmap_find_zero(struct vsfs *fs, uint32_t start_blk, uint32_t from, uint32_t nbits)
+{
+    return bitmap_find(fs, start_blk, from, nbits, 0);
+}
+
+// Searches from the hint to the end of the bitmap, then from `first` up to
+// the hint. Returns (uint32_t)-1 when every bit is set.
+static uint32_t bitmap_alloc(struct vsfs *fs, uint32_t start_blk, uint32_t nbits,
+                             uint32_t first, uint32_t *hint)
+{
+    uint32_t from = (*hint < first || *hint >= nbits) ? first : *hint;
+    uint32_t i = bitmap_find_zero(fs, start_blk, from, nbits);
+    if (i == nbits) {
+        i = bitmap_find_zero(fs, start_blk, first, from);
+        if (i == from) return (uint32_t)-1;
+    }
+    *hint = i + 1U;
+    return i;
+}
+
+// Inode 0 is the root and never handed out.
+static uint32_t inode_alloc(struct vsfs *fs)
+{
+    return bitmap_alloc(fs, fs->geo.inode_bmap_start, fs->geo.inode_count, 1U, &fs->inode_hint);
+}
+
+// Sets (used) or clears data bitmap bits [idx, idx + len) inside the
+// transaction.
+static void data_bitmap_update(struct vsfs *fs, uint32_t idx, uint32_t len, int used)
+{
+    while (len > 0) {
+        uint8_t *bm = meta_write(fs, fs->geo.data_bmap_start + idx / BITS_PER_BLOCK);
+        uint32_t bit = idx % BITS_PER_BLOCK;
+        uint32_t n = BITS_PER_BLOCK - bit < len ? BITS_PER_BLOCK - bit : len;
+        for (uint32_t i = 0; i < n; i++) {
+            if (used) vsfs_bitmap_set(bm, bit + i);
+            else vsfs_bitmap_clear(bm, bit + i);
+        }
+        idx += n;
+        len -= n;
+    }
+}
+
+// Free runs in [from, to), first fit: returns 1 once one holds want blocks,
+// otherwise leaves the longest in *best / *best_len.
+static int data_find_run(struct vsfs *fs, uint32_t from, uint32_t to, uint32_t want,
+                         uint32_t *best, uint32_t *best_len)
+{
+    uint32_t bmap = fs->geo.data_bmap_start;
+    while (from < to) {
+        uint32_t start = bitmap_find(fs, bmap, from, to, 0);
+        if (start == to) break;
+        uint32_t limit = to - start > want ? start + want : to;
+        uint32_t end = bitmap_find(fs, bmap, start, limit, 1);
+        if (end - start > *best_len) {
+            *best = start;
+            *best_len = end - start;
+        }
+        if (*best_len == want) return 1;
+        from = end;
+    }
+    return 0;
+}
+
+// Takes up to want free data blocks as one run and marks them used inside
+// the transaction. The run starting at goal (the block right after the
+// file's last extent, 0 for none) comes first, however short, so the file
+// stays one extent; then the first run from the hint that holds all of
+// want, else the longest there is. Returns the run's first block with its
+// length in *len, or 0 if the region is full.
+static uint32_t data_alloc_run(struct vsfs *fs, uint32_t goal, uint32_t want, uint32_t *len)
+{
+    const struct vsfs_geometry *g = &fs->geo;
+    uint32_t best = 0, best_len = 0;
+
+    if (goal > g->data_start && goal < g->data_start + g->data_blocks) {
+        uint32_t idx = goal - g->data_start;
+        uint32_t limit = g->data_blocks - idx > want ? idx + want : g->data_blocks;
+        best = idx;
+        best_len = bitmap_find(fs, g->data_bmap_start, idx, limit, 1) - idx;
+    }
+    if (best_len == 0) {
+        uint32_t from = fs->data_hint < g->data_blocks ? fs->data_hint : 0;
+        if (!data_find_run(fs, from, g->data_blocks, want, &best, &best_len)) {
+            data_find_run(fs, 0, from, want, &best, &best_len);
+        }
+        if (best_len == 0) return 0;
+    }
+
+    data_bitmap_update(fs, best, best_len, 1);
+    fs->data_hint = best + best_len;
+    *len = best_len;
+    return g->data_start + best;
+}
+
+// Takes a free data block and zeroes it inside the transaction; 0 if full.
+static uint32_t data_alloc(struct vsfs *fs)
+{
+    uint32_t len;
+    uint32_t blk = data_alloc_run(fs, 0, 1, &len);
+    if (blk != 0) memset(meta_write(fs, blk), 0, BLOCK_SIZE);
+    return blk;
+}
+
+// Extent i of an extent-mapped inode, from the inode or its extent block;
+// NULL past the end of the list's storage.
+static const struct extent *extent_read(struct vsfs *fs, const struct inode *ino, uint32_t i)
+{
+    if (i < INODE_EXTENTS) return &ino->extents[i];
+    if (ino->extent_block == 0 || i - INODE_EXTENTS >= EXTENTS_PER_BLOCK) return NULL;
+    return (const struct extent *)meta_read(fs, ino->extent_block) + (i - INODE_EXTENTS);
+}
+
+static uint32_t extent_count(struct vsfs *fs, const struct inode *ino)
+{
+    uint32_t n = 0;
+    const struct extent *e;
+    while ((e = extent_read(fs, ino, n)) != NULL && e->len != 0) n++;
+    return n;
+}
+
+// Disk block holding block fblk of the file, with *n set to how many of
+// the following file blocks (at most max) lie right after it on disk;
+// 0 if the file has no block fblk.
+static uint32_t inode_bmap_run(struct vsfs *fs, const struct inode *ino, uint32_t fblk,
+                               uint32_t max, uint32_t *n)
+{
+    *n = 0;
+    if (!(ino->flags & INODE_FLAG_EXTENTS)) {
+        uint32_t blk = fblk < DIRECT_POINTERS ? ino->direct[fblk] : 0;
+        if (blk == 0) return 0;
+        do {
+            (*n)++;
+        } while (*n < max && fblk + *n < DIRECT_POINTERS && ino->direct[fblk + *n] == blk + *n);
+        return blk;
+    }
+    const struct extent *e;
+    for (uint32_t i = 0; (e = extent_read(fs, ino, i)) != NULL && e->len != 0; i++) {
+        if (fblk < e->len) {
+            *n = e->len - fblk < max ? e->len - fblk : max;
+            return e->start + fblk;
+        }
+        fblk -= e->len;
+    }
+    return 0;
+}
+
+// Disk block holding block fblk of the file, 0 if it has none.
+static uint32_t inode_bmap(struct vsfs *fs, const struct inode *ino, uint32_t fblk)
+{
+    uint32_t n;
+    return inode_bmap_run(fs, ino, fblk, 1, &n);
+}
+
+// Adds blocks [start, start + len) at the end of the file, merging them into
+// the last extent when they follow it on disk.
+static int extent_append(struct vsfs *fs, uint32_t inum, uint32_t start, uint32_t len)
+{
+    const struct inode *ino = inode_read(fs, inum);
+    uint32_t n = extent_count(fs, ino);
+    if (n > 0) {
+        const struct extent *last = extent_read(fs, ino, n - 1U);
+        if (last->start + last->len == start) {
+            n--;
+            start = last->start;
+            len += last->len;
+        }
+    }
+    if (n >= INODE_EXTENTS + EXTENTS_PER_BLOCK) {
+        fprintf(stderr, "vsfs: inode %u has too many extents\n", inum);
+        return -1;
+    }
+
+    struct extent *e;
+    if (n < INODE_EXTENTS) {
+        e = &inode_write(fs, inum)->extents[n];
+    } else {
+        if (ino->extent_block == 0) {
+            uint32_t blk = data_alloc(fs);
+            if (blk == 0) {
+                fprintf(stderr, "vsfs: no free data block for extent list\n");
+                return -1;
+            }
+            inode_write(fs, inum)->extent_block = blk;
+            ino = inode_read(fs, inum);
+        }
+        e = (struct extent *)meta_write(fs, ino->extent_block) + (n - INODE_EXTENTS);
+    }
+    e->start = start;
+    e->len = len;
+    return 0;
+}
+
+// Rewrites a direct-pointer inode's blocks as extents.
+static int inode_convert_extents(struct vsfs *fs, uint32_t inum)
+{
+    struct inode *ino = inode_write(fs, inum);
+    uint32_t direct[DIRECT_POINTERS];
+    memcpy(direct, ino->direct, sizeof(direct));
+    memset(ino->extents, 0, sizeof(ino->extents));
+    ino->flags |= INODE_FLAG_EXTENTS;
+    ino->extent_block = 0;
+
+    for (uint32_t i = 0; i < DIRECT_POINTERS && direct[i] != 0; i++) {
+        if (extent_append(fs, inum, direct[i], 1) != 0) return -1;
+    }
+    return 0;
+}
+
+// Gives the file nblocks more blocks, in as few runs as the free space
+// allows, each extending the file's last extent if it can. Directory
+// blocks are metadata and are zeroed inside the transaction.
+static int inode_grow(struct vsfs *fs, uint32_t inum, uint32_t nblocks, int zero)
+{
+    if (!(inode_read(fs, inum)->flags & INODE_FLAG_EXTENTS) && inode_convert_extents(fs, inum) != 0) {
+        return -1;
+    }
+    while (nblocks > 0) {
+        const struct inode *ino = inode_read(fs, inum);
+        uint32_t n = extent_count(fs, ino);
+        uint32_t goal = 0;
+        if (n > 0) {
+            const struct extent *last = extent_read(fs, ino, n - 1U);
+            goal = last->start + last->len;
+        }
+
+        uint32_t len;
+        uint32_t blk = data_alloc_run(fs, goal, nblocks, &len);
+        if (blk == 0) {
+            fprintf(stderr, "vsfs: no free data blocks\n");
+            return -1;
+        }
+        if (zero) {
+            for (uint32_t i = 0; i < len; i++) memset(meta_write(fs, blk + i), 0, BLOCK_SIZE);
+        }
+        if (extent_append(fs, inum, blk, len) != 0) return -1;
+        nblocks -= len;
+    }
+    return 0;
+}
+
+static const struct dirent *dirent_read(struct vsfs *fs, const struct inode *dir, uint32_t pos)
+{
+    const uint8_t *blk = meta_read(fs, inode_bmap(fs, dir, pos / DIRENTS_PER_BLOCK));
+    return (const struct dirent *)blk + pos % DIRENTS_PER_BLOCK;
+}
+
+#define DIR_LOOKUP_CORRUPT (-2)
+
+// Probes the directory index for name. Returns the entry's position, or -1
+// with *free_slot set to the slot an insert of name would take. An index
+// with no empty slot on the probe path, or one naming an entry past the end
+// of the directory, is corrupt: DIR_LOOKUP_CORRUPT after printing why.
+static int64_t dir_lookup(struct vsfs *fs, const struct inode *dir, const char *name,
+                          uint32_t *free_slot)
+{
+    const uint16_t *slots = (const uint16_t *)meta_read(fs, dir->index_block);
+    uint32_t nents = dir->size / (uint32_t)sizeof(struct dirent);
+    uint32_t s = vsfs_dir_index_home(name);
+
+    for (uint32_t probes = 0; probes < DIR_INDEX_SLOTS; probes++) {
+        if (slots[s] == 0) {
+            *free_slot = s;
+            return -1;
+        }
+        uint32_t pos = slots[s] - 1U;
+        if (pos >= nents) {
+            fprintf(stderr, "vsfs: directory index names entry %u past the end (corrupt?)\n", pos);
+            return DIR_LOOKUP_CORRUPT;
+        }
+        if (strncmp(dirent_read(fs, dir, pos)->name, name, NAME_LEN) == 0) return pos;
+        s = vsfs_dir_index_next(s);
+    }
+    fprintf(stderr, "vsfs: directory index full (corrupt?)\n");
+    return DIR_LOOKUP_CORRUPT;
+}
+
+// Directories from images without an index get one on their first insert,
+// built from the existing entries as part of that insert's transaction.
+static int dir_index_build(struct vsfs *fs, uint32_t dir_inum)
+{
+    uint32_t blk = data_alloc(fs);
+    if (blk == 0) {
+        fprintf(stderr, "create: no free data block for directory index\n");
+        return -1;
+    }
+    inode_write(fs, dir_inum)->index_block = blk;
+
+    const struct inode *dir = inode_read(fs, dir_inum);
+    uint16_t *slots = (uint16_t *)meta_write(fs, blk);
+    uint32_t nents = dir->size / (uint32_t)sizeof(struct dirent);
+
+    for (uint32_t pos = 0; pos < nents; pos++) {
+        const struct dirent *de = dirent_read(fs, dir, pos);
+        if (de->name[0] == '\0') continue;
+
+        uint32_t s = vsfs_dir_index_home(de->name);
+        uint32_t probes = 0;
+        while (slots[s] != 0 && ++probes < DIR_INDEX_SLOTS) s = vsfs_dir_index_next(s);
+        if (slots[s] != 0) {
+            fprintf(stderr, "create: directory has more entries than its index holds\n");
+            return -1;
+        }
+        slots[s] = (uint16_t)(pos + 1U);
+    }
+    return 0;
+}
+
+static int check_root(struct vsfs *fs)
+{
+    const struct inode *root = inode_read(fs, 0);
+
+    if (root->type != 2) {
+        fprintf(stderr, "create: root inode not a directory\n");
+        return -1;
+    }
+    if (inode_bmap(fs, root, 0) == 0) {
+        fprintf(stderr, "create: root directory has no data block\n");
+        return -1;
+    }
+    return 0;
+}
+
+// (Re)builds the cache from the image: the committed journal is replayed
+// once and its images become the initial contents.
+static void cache_load(struct vsfs *fs)
+{
+    fs->cache = bcache_open(fs->fd, VSFS_CACHE_BLOCKS);
+
+    journal_read_header(fs->fd, &fs->geo, &fs->jh);
+    if (journal_check_old(&fs->jh) != 0) exit(1);
+    fs->journal_ready = journal_header_valid(&fs->geo, &fs->jh);
+    if (!fs->journal_ready) journal_header_empty(&fs->jh, 1U);
+    fs->log_end = fs->jh.tail;
+    fs->log_end_seq = fs->jh.tail_seq;
+
+    if (fs->jh.head != fs->jh.tail) {
+        struct journal_map jm;
+        struct journal_iter end;
+        struct image_map latest;
+        image_map_init(&latest);
+        journal_map_open(fs->fd, &fs->geo, &jm);
+        journal_collect_latest_committed(fs->fd, &jm, &fs->jh, &latest, &end);
+        for (uint32_t i = 0; i < latest.count; i++) {
+            bcache_put(fs->cache, latest.blocks[i], latest.images[i]);
+        }
+        fs->log_end = end.pos;
+        fs->log_end_seq = end.seq;
+        image_map_free(&latest);
+        journal_map_close(&jm);
+    }
+    bcache_pin(fs->cache, fs->geo.inode_start);    // root inode, read by every create
+}
+
+// Serialises commits and installs across processes sharing the image.
+static void lock_image(int fd, int op)
+{
+    while (flock(fd, op) != 0) {
+        if (errno != EINTR) die("flock");
+    }
+}
+
+static void lock_fs(struct vsfs *fs, int op)
+{
+    lock_image(fs->fd, op);
+    fs->syscalls++;
+}
+
+// Called with the image locked: if another process has committed or
+// installed since this handle last looked, the cache no longer matches the
+// journal and is rebuilt.
+static void cache_refresh(struct vsfs *fs)
+{
+    struct journal_header disk;
+    journal_read_header(fs->fd, &fs->geo, &disk);
+    fs->syscalls++;
+    int valid = journal_header_valid(&fs->geo, &disk);
+    if (valid == fs->journal_ready && (!valid || memcmp(&disk, &fs->jh, sizeof(disk)) == 0)) return;
+    bcache_close(fs->cache);
+    cache_load(fs);
+}
+
+struct vsfs *vsfs_open(const char *path)
+{
+    struct vsfs *fs = malloc(sizeof(*fs));
+    if (!fs) die("malloc vsfs");
+
+    fs->fd = open_image_rw(path);
+    fs->sync = VSFS_SYNC_ORDERED;
+    fs->ring = NULL;
+    fs->checkpoint_pct = VSFS_DEFAULT_CHECKPOINT_PCT;
+    image_map_init(&fs->work);
+    fs->inode_hint = 0;
+    fs->data_hint = 0;
+    pthread_mutex_init(&fs->mu, NULL);
+    pthread_cond_init(&fs->cv, NULL);
+    fs->queue = NULL;
+    fs->queue_tail = &fs->queue;
+    fs->busy = 0;
+    fs->window_us = 0;
+    fs->commits = 0;
+    fs->commit_requests = 0;
+    fs->journal_bytes = 0;
+    fs->data_bytes = 0;
+    fs->syscalls = 0;
+
+    uint8_t sb_block[BLOCK_SIZE];
+    read_block(fs->fd, SB_BLOCK_NO, sb_block);
+    const char *err = vsfs_geometry_from_sb((const struct superblock *)sb_block, &fs->geo);
+    if (err) {
+        fprintf(stderr, "vsfs: %s\n", err);
+        close(fs->fd);
+        free(fs);
+        return NULL;
+    }
+
+    lock_fs(fs, LOCK_SH);    // no other process is halfway through a commit or install
+    cache_load(fs);
+    int rc = check_root(fs);
+    lock_fs(fs, LOCK_UN);
+    if (rc != 0) {
+        vsfs_close(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+void vsfs_close(struct vsfs *fs)
+{
+    if (!fs) return;
+    uring_close(fs->ring);
+    if (close(fs->fd) != 0) die("close");
+    bcache_close(fs->cache);
+    image_map_free(&fs->work);
+    pthread_cond_destroy(&fs->cv);
+    pthread_mutex_destroy(&fs->mu);
+    free(fs);
+}
+
+void vsfs_get_stats(const struct vsfs *fs, struct vsfs_stats *st)
+{
+    struct bcache_stats cs;
+    bcache_get_stats(fs->cache, &cs);
+    st->cache_hits = cs.hits;
+    st->cache_misses = cs.misses;
+    st->cache_evictions = cs.evictions;
+    st->commits = fs->commits;
+    st->commit_requests = fs->commit_requests;
+    st->journal_bytes = fs->journal_bytes;
+    st->data_bytes = fs->data_bytes;
+    st->syscalls = fs->syscalls + cs.misses + cs.write_calls;
+    if (fs->ring) st->syscalls += uring_syscalls(fs->ring);
+}
+
+void vsfs_set_sync(struct vsfs *fs, enum vsfs_sync mode)
+{
+    fs->sync = mode;
+}
+
+int vsfs_set_io(struct vsfs *fs, enum vsfs_io mode)
+{
+    if (fs->ring) fs->syscalls += uring_syscalls(fs->ring);
+    uring_close(fs->ring);
+    fs->ring = NULL;
+    if (mode == VSFS_IO_SYNC) return 0;
+    fs->ring = uring_open(URING_ENTRIES);
+    return fs->ring ? 0 : -1;
+}
+
+void vsfs_set_checkpoint(struct vsfs *fs, unsigned percent)
+{
+    fs->checkpoint_pct = percent > 100U ? 100U : percent;
+}
+
+void vsfs_set_group_window(struct vsfs *fs, unsigned usec)
+{
+    fs->window_us = usec;
+}
+
+
+// Checkpoints inline when the next transaction would not fit, so writers
+// never see "journal full" unless a single transaction exceeds the journal.
+static int journal_make_room(struct vsfs *fs, const struct txn *t)
+{
+    if (txn_fits(&fs->geo, &fs->jh, t) || fs->checkpoint_pct == 0) return 0;
+    if (JOURNAL_LOG_START + txn_commit_bytes(t) > journal_capacity_bytes(&fs->geo)) {
+        fprintf(stderr, "ERROR: transaction of %u bytes does not fit in the journal\n",
+                txn_commit_bytes(t));
+        return -1;
+    }
+    return journal_install(fs) < 0 ? -1 : 0;
+}
+
+static int journal_maybe_checkpoint(struct vsfs *fs)
+{
+    if (fs->checkpoint_pct == 0) return 0;
+    uint64_t limit = (uint64_t)journal_capacity_bytes(&fs->geo) * fs->checkpoint_pct / 100U;
+    if (journal_used_bytes(&fs->geo, &fs->jh) < limit) return 0;
+    return journal_install(fs) < 0 ? -1 : 0;
+}
+
+static int apply_create(struct vsfs *fs, const char *name, time_t now)
+{
+    if (!name || name[0] == '\0') {
+        fprintf(stderr, "create: missing name\n");
+        return -1;
+    }
+    if (strlen(name) >= NAME_LEN) {
+        fprintf(stderr, "create: name too long (max %u chars)\n", (unsigned)(NAME_LEN - 1));
+        return -1;
+    }
+
+    
+    uint32_t new_inum = inode_alloc(fs);
+    if (new_inum == (uint32_t)-1) {
+        fprintf(stderr, "create: no free inode\n");
+        return -1;
+    }
+    if (inode_read(fs, new_inum)->type != 0) {
+        fprintf(stderr, "create: picked inode not free (corrupt?)\n");
+        return -1;
+    }
+
+    const struct inode *root = inode_read(fs, 0);
+    if (root->index_block == 0) {
+        if (dir_index_build(fs, 0) != 0) return -1;
+        root = inode_read(fs, 0);
+    }
+
+    uint32_t used_entries = root->size / (uint32_t)sizeof(struct dirent);
+    if (used_entries < 2) used_entries = 2; 
+    if (used_entries >= DIR_MAX_ENTRIES) {
+        fprintf(stderr, "create: directory full\n");
+        return -1;
+    }
+
+    uint32_t slot;
+    int64_t found = dir_lookup(fs, root, name, &slot);
+    if (found == DIR_LOOKUP_CORRUPT) return -1;
+    if (found >= 0) {
+        fprintf(stderr, "create: file already exists: %s\n", name);
+        return -1;
+    }
+
+    // the next entry may start a new dirent block
+    uint32_t dir_slot = used_entries / DIRENTS_PER_BLOCK;
+    uint32_t dir_blk = inode_bmap(fs, root, dir_slot);
+    if (dir_blk == 0) {
+        if (inode_grow(fs, 0, 1, 1) != 0) return -1;
+        root = inode_read(fs, 0);
+        dir_blk = inode_bmap(fs, root, dir_slot);
+    }
+
+    inode_bitmap_set(fs, new_inum);
+
+    struct inode ni;
+    memset(&ni, 0, sizeof(ni));
+    ni.type  = 1;
+    ni.links = 1;
+    ni.size  = 0;
+    ni.flags = INODE_FLAG_EXTENTS;
+    ni.ctime = (uint32_t)now;
+    ni.mtime = (uint32_t)now;
+    *inode_write(fs, new_inum) = ni;
+
+    
+    struct dirent *de = (struct dirent *)meta_write(fs, dir_blk)
+                        + used_entries % DIRENTS_PER_BLOCK;
+    de->inode = new_inum;
+    memset(de->name, 0, NAME_LEN);
+    strncpy(de->name, name, NAME_LEN - 1);
+    ((uint16_t *)meta_write(fs, root->index_block))[slot] = (uint16_t)(used_entries + 1U);
+
+    struct inode *wroot = inode_write(fs, 0);
+    wroot->size = used_entries * (uint32_t)sizeof(struct dirent) + (uint32_t)sizeof(struct dirent);
+    wroot->mtime = (uint32_t)now;
+    return 0;
+}
+
+// Applies every request of the group that has not failed yet; returns the
+// first one that fails, leaving its changes mixed into fs->work.
+static struct group_req *group_apply(struct vsfs *fs, struct group_req *group, time_t now)
+{
+    for (struct group_req *r = group; r; r = r->next) {
+        if (r->rc < 0) continue;
+        for (unsigned i = 0; i < r->nnames; i++) {
+            if (apply_create(fs, r->names[i], now) != 0) return r;
+        }
+    }
+    return NULL;
+}
+
+static void group_finish(struct group_req *group, int rc)
+{
+    for (struct group_req *r = group; r; r = r->next) {
+        if (r->rc > 0) r->rc = rc;
+    }
+}
+
+// The changes in fs->work, block by block, as a transaction.
+static void work_txn(struct vsfs *fs, struct txn *t)
+{
+    txn_begin(t);
+    for (uint32_t i = 0; i < fs->work.count; i++) {
+        uint32_t blk = fs->work.blocks[i];
+        txn_add_changes(t, blk, meta_cur(fs, blk), fs->work.images[i]);
+    }
+}
+
+// Commits t, built by work_txn, and on success moves fs->work into the
+// cache. fs->work is empty afterwards either way.
+static int work_commit(struct vsfs *fs, struct txn *t)
+{
+    int rc = journal_make_room(fs, t);
+    if (rc == 0) rc = journal_commit_txn(fs, t);
+    txn_free(t);
+
+    if (rc == 0) {
+        for (uint32_t i = 0; i < fs->work.count; i++) {
+            bcache_put(fs->cache, fs->work.blocks[i], fs->work.images[i]);
+        }
+        fs->commits++;
+    }
+    image_map_clear(&fs->work);
+    return rc;
+}
+
+// Logs the group as one transaction with one commit record. A request that
+// fails is dropped and the rest are applied again without it, so each
+// request is still all or nothing. Called with the image locked.
+static void group_commit(struct vsfs *fs, struct group_req *group)
+{
+    time_t now = time(NULL);
+    uint32_t inode_hint = fs->inode_hint, data_hint = fs->data_hint;
+    bcache_hold_begin(fs->cache);    // work copies and the txn refer to cached images
+
+    struct group_req *bad;
+    while ((bad = group_apply(fs, group, now)) != NULL) {
+        bad->rc = -1;
+        image_map_clear(&fs->work);
+        fs->inode_hint = inode_hint;
+        fs->data_hint = data_hint;
+    }
+    if (fs->work.count == 0) {
+        bcache_hold_end(fs->cache);
+        group_finish(group, 0);
+        return;
+    }
+
+    // what the group changed in each block is logged once, followed by one commit
+    struct txn t;
+    work_txn(fs, &t);
+
+    int too_big = JOURNAL_LOG_START + txn_commit_bytes(&t) > journal_capacity_bytes(&fs->geo);
+    if (too_big && group->next) {
+        // together they do not fit even in an empty journal: commit one by one
+        txn_free(&t);
+        image_map_clear(&fs->work);
+        bcache_hold_end(fs->cache);
+        fs->inode_hint = inode_hint;
+        fs->data_hint = data_hint;
+        while (group) {
+            struct group_req *next = group->next;
+            group->next = NULL;
+            if (group->rc > 0) group_commit(fs, group);
+            group->next = next;
+            group = next;
+        }
+        return;
+    }
+
+    int rc = work_commit(fs, &t);
+    if (rc == 0) {
+        for (struct group_req *r = group; r; r = r->next) fs->commit_requests += r->rc > 0;
+    }
+    bcache_hold_end(fs->cache);
+    if (rc != 0) {
+        fs->inode_hint = inode_hint;
+        fs->data_hint = data_hint;
+        group_finish(group, -1);
+        return;
+    }
+
+    group_finish(group, journal_maybe_checkpoint(fs));
+}
+
+// Waits until no leader or install owns the journal, then takes it.
+static void journal_acquire(struct vsfs *fs)
+{
+    while (fs->busy) pthread_cond_wait(&fs->cv, &fs->mu);
+    fs->busy = 1;
+}
+
+static void journal_release(struct vsfs *fs)
+{
+    fs->busy = 0;
+    pthread_cond_broadcast(&fs->cv);
+}
+
+int vsfs_create_many(struct vsfs *fs, const char *const names[], unsigned nnames)
+{
+    if (nnames == 0) return 0;
+
+    struct group_req req = { names, nnames, 1, 0, NULL };
+    pthread_mutex_lock(&fs->mu);
+    *fs->queue_tail = &req;
+    fs->queue_tail = &req.next;
+
+    // a leader that started before we queued does not take us; the next one will
+    while (fs->busy && !req.done) pthread_cond_wait(&fs->cv, &fs->mu);
+    if (req.done) {
+        pthread_mutex_unlock(&fs->mu);
+        return req.rc;
+    }
+
+    fs->busy = 1;    // leader
+    if (fs->window_us) {
+        // let more writers join before the group is closed
+        pthread_mutex_unlock(&fs->mu);
+        usleep(fs->window_us);
+        pthread_mutex_lock(&fs->mu);
+    }
+    struct group_req *group = fs->queue;
+    fs->queue = NULL;
+    fs->queue_tail = &fs->queue;
+    pthread_mutex_unlock(&fs->mu);
+
+    lock_fs(fs, LOCK_EX);
+    cache_refresh(fs);
+    group_commit(fs, group);
+    lock_fs(fs, LOCK_UN);
+
+    pthread_mutex_lock(&fs->mu);
+    for (struct group_req *r = group, *next; r; r = next) {
+        next = r->next;    // r may be gone as soon as done is set
+        r->done = 1;
+    }
+    journal_release(fs);
+    pthread_mutex_unlock(&fs->mu);
+    return req.rc;
+}
+
+int vsfs_create(struct vsfs *fs, const char *name)
+{
+    return vsfs_create_many(fs, &name, 1);
+}
+
+// Inode number of name in the root directory, -1 if there is none, or
+// DIR_LOOKUP_CORRUPT. Directories from images without an index are searched
+// entry by entry.
+static int64_t root_lookup(struct vsfs *fs, const char *name)
+{
+    const struct inode *root = inode_read(fs, 0);
+    if (root->index_block != 0) {
+        uint32_t slot;
+        int64_t pos = dir_lookup(fs, root, name, &slot);
+        return pos < 0 ? pos : (int64_t)dirent_read(fs, root, (uint32_t)pos)->inode;
+    }
+    uint32_t nents = root->size / (uint32_t)sizeof(struct dirent);
+    for (uint32_t pos = 0; pos < nents; pos++) {
+        const struct dirent *de = dirent_read(fs, root, pos);
+        if (de->name[0] != '\0' && strncmp(de->name, name, NAME_LEN) == 0) return de->inode;
+    }
+    return -1;
+}
+
+// Reads until buf is full or the source ends; -1 on a read error.
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+// File contents go to their home blocks directly, never through the cache
+// or the journal.
+static void data_write(struct vsfs *fs, const uint8_t *buf, uint32_t blk, uint32_t nblocks)
+{
+    uint32_t len = nblocks * BLOCK_SIZE;
+    fs->data_bytes += len;
+    if (!fs->ring) {
+        pwrite_exact(fs->fd, buf, len, (off_t)blk * BLOCK_SIZE);
+        fs->syscalls++;
+        return;
+    }
+    uring_write(fs->ring, fs->fd, buf, len, (off_t)blk * BLOCK_SIZE, 0);
+}
+
+// Empties file inum's block list inside the transaction and returns its
+// old blocks as runs, to be freed once the new contents have been placed:
+// until then the allocator still sees them as used, so a rewrite never
+// lands on the blocks the committed file points at. The extent block is
+// kept, emptied, for the new list; the journal may still hold records for
+// it, and an install replaying those over file data put there in the
+// meantime would corrupt it.
+static struct extent *inode_take_blocks(struct vsfs *fs, uint32_t inum, uint32_t *nruns)
+{
+    const struct inode *ino = inode_read(fs, inum);
+    uint32_t nblocks = vsfs_div_round_up(ino->size, BLOCK_SIZE);
+    struct extent *runs = NULL;
+    uint32_t cap = 0;
+    *nruns = 0;
+    for (uint32_t fblk = 0, n; fblk < nblocks; fblk += n) {
+        uint32_t blk = inode_bmap_run(fs, ino, fblk, nblocks - fblk, &n);
+        if (blk == 0) break;
+        if (*nruns == cap) {
+            cap = cap ? 2U * cap : 16U;
+            runs = realloc(runs, cap * sizeof(*runs));
+            if (!runs) die("realloc runs");
+        }
+        runs[*nruns].start = blk;
+        runs[*nruns].len = n;
+        (*nruns)++;
+    }
+
+    struct inode *w = inode_write(fs, inum);
+    memset(w->extents, 0, sizeof(w->extents));
+    w->flags |= INODE_FLAG_EXTENTS;
+    w->size = 0;
+    if (w->extent_block != 0) memset(meta_write(fs, w->extent_block), 0, BLOCK_SIZE);
+    return runs;
+}
+
+// Sizes are 32-bit; whole blocks keep the block count from overflowing.
+#define VSFS_FILE_MAX (UINT32_MAX / BLOCK_SIZE * BLOCK_SIZE)
+
+// Streams src_fd into the extent-mapped, empty file inum; returns the size.
+static int64_t stream_file(struct vsfs *fs, uint32_t inum, int src_fd)
+{
+    uint8_t *buf = aligned_alloc(BLOCK_SIZE, VSFS_FILE_CHUNK);
+    if (!buf) die("aligned_alloc");
+
+    uint64_t size = 0;
+    for (;;) {
+        ssize_t got = read_full(src_fd, buf, VSFS_FILE_CHUNK);
+        if (got < 0) {
+            perror("write: read source");
+            free(buf);
+            return -1;
+        }
+        if (got == 0) break;
+        if (size + (uint64_t)got > VSFS_FILE_MAX) {
+            fprintf(stderr, "write: file larger than %u bytes\n", VSFS_FILE_MAX);
+            free(buf);
+            return -1;
+        }
+
+        // the tail of the last block is zero on disk
+        uint32_t nblocks = vsfs_div_round_up((uint32_t)got, BLOCK_SIZE);
+        memset(buf + got, 0, (size_t)nblocks * BLOCK_SIZE - (size_t)got);
+        uint32_t first = (uint32_t)(size / BLOCK_SIZE);
+        if (inode_grow(fs, inum, nblocks, 0) != 0) {
+            free(buf);
+            return -1;
+        }
+        const struct inode *ino = inode_read(fs, inum);
+        for (uint32_t i = 0, n; i < nblocks; i += n) {
+            uint32_t blk = inode_bmap_run(fs, ino, first + i, nblocks - i, &n);
+            data_write(fs, buf + (size_t)i * BLOCK_SIZE, blk, n);
+        }
+        io_flush(fs);    // buf is reused for the next chunk
+        size += (uint64_t)got;
+        if ((size_t)got < VSFS_FILE_CHUNK) break;
+    }
+    free(buf);
+    return (int64_t)size;
+}
+
+// Called with the image locked and the cache held; leaves the changes in
+// fs->work for the caller to commit or drop.
+static int64_t apply_write(struct vsfs *fs, const char *name, int src_fd, time_t now)
+{
+    struct extent *old = NULL;
+    uint32_t nold = 0;
+    int64_t inum = root_lookup(fs, name);
+    if (inum == DIR_LOOKUP_CORRUPT) return -1;
+    if (inum < 0) {
+        if (apply_create(fs, name, now) != 0) return -1;
+        inum = root_lookup(fs, name);
+    } else if (inode_read(fs, (uint32_t)inum)->type != 1) {
+        fprintf(stderr, "write: not a regular file: %s\n", name);
+        return -1;
+    } else {
+        old = inode_take_blocks(fs, (uint32_t)inum, &nold);
+    }
+
+    int64_t size = stream_file(fs, (uint32_t)inum, src_fd);
+    if (size >= 0) {
+        for (uint32_t i = 0; i < nold; i++) {
+            data_bitmap_update(fs, old[i].start - fs->geo.data_start, old[i].len, 0);
+        }
+        struct inode *ino = inode_write(fs, (uint32_t)inum);
+        ino->size = (uint32_t)size;
+        ino->mtime = (uint32_t)now;
+    }
+    free(old);
+    return size;
+}
+
+int64_t vsfs_write_file(struct vsfs *fs, const char *name, int src_fd)
+{
+    pthread_mutex_lock(&fs->mu);
+    journal_acquire(fs);
+    pthread_mutex_unlock(&fs->mu);
+
+    lock_fs(fs, LOCK_EX);
+    cache_refresh(fs);
+    uint32_t inode_hint = fs->inode_hint, data_hint = fs->data_hint;
+    bcache_hold_begin(fs->cache);
+
+    int64_t size = apply_write(fs, name, src_fd, time(NULL));
+    int rc = size < 0 ? -1 : 0;
+    if (rc == 0) {
+        // ordered data: the contents are on disk before the commit that points at them
+        if (fs->sync != VSFS_SYNC_NONE) io_barrier(fs);
+        io_flush(fs);
+        struct txn t;
+        work_txn(fs, &t);
+        rc = work_commit(fs, &t);
+    }
+    image_map_clear(&fs->work);
+    bcache_hold_end(fs->cache);
+    if (rc == 0) {
+        fs->commit_requests++;
+        rc = journal_maybe_checkpoint(fs);
+    } else {
+        fs->inode_hint = inode_hint;
+        fs->data_hint = data_hint;
+    }
+    lock_fs(fs, LOCK_UN);
+
+    pthread_mutex_lock(&fs->mu);
+    journal_release(fs);
+    pthread_mutex_unlock(&fs->mu);
+    return rc == 0 ? size : -1;
+}
+
+int64_t vsfs_read_file(struct vsfs *fs, const char *name, int out_fd)
+{
+    pthread_mutex_lock(&fs->mu);
+    journal_acquire(fs);
+    pthread_mutex_unlock(&fs->mu);
+
+    // a shared lock keeps other processes from reusing the blocks meanwhile
+    lock_fs(fs, LOCK_SH);
+    cache_refresh(fs);
+    bcache_hold_begin(fs->cache);
+
+    int64_t copied = -1;
+    int64_t inum = root_lookup(fs, name);
+    if (inum == DIR_LOOKUP_CORRUPT) {
+        // already reported
+    } else if (inum < 0) {
+        fprintf(stderr, "cat: no such file: %s\n", name);
+    } else if (inode_read(fs, (uint32_t)inum)->type != 1) {
+        fprintf(stderr, "cat: not a regular file: %s\n", name);
+    } else {
+        const struct inode *ino = inode_read(fs, (uint32_t)inum);
+        uint8_t *buf = aligned_alloc(BLOCK_SIZE, VSFS_FILE_CHUNK);
+        if (!buf) die("aligned_alloc");
+        uint32_t size = ino->size;
+        uint32_t nblocks = vsfs_div_round_up(size, BLOCK_SIZE);
+        copied = 0;
+        for (uint32_t fblk = 0, n; fblk < nblocks; fblk += n) {
+            uint32_t max = nblocks - fblk < VSFS_FILE_CHUNK / BLOCK_SIZE ? nblocks - fblk : VSFS_FILE_CHUNK / BLOCK_SIZE;
+            uint32_t blk = inode_bmap_run(fs, ino, fblk, max, &n);
+            if (blk == 0) {
+                fprintf(stderr, "cat: %s has no block %u (corrupt?)\n", name, fblk);
+                copied = -1;
+                break;
+            }
+            uint32_t len = size - (uint32_t)copied < n * BLOCK_SIZE ? size - (uint32_t)copied : n * BLOCK_SIZE;
+            pread_exact(fs->fd, buf, len, (off_t)blk * BLOCK_SIZE);
+            fs->syscalls++;
+            for (uint32_t off = 0; off < len;) {
+                ssize_t w = write(out_fd, buf + off, len - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) die("write");
+                off += (uint32_t)w;
+            }
+            copied += len;
+        }
+        free(buf);
+    }
+
+    bcache_hold_end(fs->cache);
+    lock_fs(fs, LOCK_UN);
+
+    pthread_mutex_lock(&fs->mu);
+    journal_release(fs);
+    pthread_mutex_unlock(&fs->mu);
+    return copied;
+}
+
+int vsfs_journal_overlay(const char *path,
+                         void (*fn)(void *ctx, uint32_t block_no, const uint8_t *image),
+                         void *ctx)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) die("open");
+
+    uint8_t sb_block[BLOCK_SIZE];
+    read_block(fd, SB_BLOCK_NO, sb_block);
+    struct vsfs_geometry geo;
+    const char *err = vsfs_geometry_from_sb((const struct superblock *)sb_block, &geo);
+    if (err) {
+        fprintf(stderr, "vsfs: %s\n", err);
+        close(fd);
+        return -1;
+    }
+
+    lock_image(fd, LOCK_SH);
+    struct journal_header jh;
+    journal_read_header(fd, &geo, &jh);
+    if (journal_check_old(&jh) != 0) {
+        lock_image(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+    int nblocks = 0;
+    if (journal_header_valid(&geo, &jh) && jh.head != jh.tail) {
+        struct journal_map jm;
+        struct image_map latest;
+        image_map_init(&latest);
+        journal_map_open(fd, &geo, &jm);
+        journal_collect_latest_committed(fd, &jm, &jh, &latest, NULL);
+        for (uint32_t i = 0; i < latest.count; i++) {
+            fn(ctx, latest.blocks[i], latest.images[i]);
+        }
+        nblocks = (int)latest.count;
+        image_map_free(&latest);
+        journal_map_close(&jm);
+    }
+    lock_image(fd, LOCK_UN);
+
+    if (close(fd) != 0) die("close");
+    return nblocks;
+}
+
+static void ring_write_run(void *ctx, const struct iovec *iov, unsigned iovcnt, uint32_t first_block)
+{
+    struct vsfs *fs = ctx;
+    uring_writev(fs->ring, fs->fd, iov, iovcnt, (off_t)first_block * BLOCK_SIZE, 0);
+}
+
+static int journal_install(struct vsfs *fs)
+{
+    if (!fs->journal_ready) {
+        fprintf(stderr, "ERROR: journal not initialized\n");
+        return -1;
+    }
+
+    // Every committed transaction's blocks are already in the cache with
+    // their final contents, so each block is written once, in block order,
+    // however many transactions touched it.
+    int commits = (int)(fs->log_end_seq - fs->jh.head_seq);
+    if (fs->ring) {
+        bcache_flush_to(fs->cache, ring_write_run, fs);    // unlinked: runs may complete in any order
+    } else {
+        bcache_flush(fs->cache);
+    }
+
+    // checkpointed blocks must be durable before the log that covers them is dropped
+    if (fs->sync != VSFS_SYNC_NONE) {
+        if (fs->ring) uring_fdatasync(fs->ring, fs->fd, URING_DRAIN | URING_LINK);
+        else io_barrier(fs);
+    }
+
+    // everything committed is installed: move head past it, nothing is zeroed
+    struct journal_header installed = fs->jh;
+    installed.head = fs->log_end == journal_capacity_bytes(&fs->geo) ? JOURNAL_LOG_START : fs->log_end;
+    installed.tail = installed.head;
+    installed.head_seq = fs->jh.tail_seq;
+    // Records past the last intact commit were torn by a crash. Their
+    // sequence numbers are skipped, so none of them can pass for part of a
+    // later transaction written over the same place.
+    if (fs->log_end_seq != fs->jh.tail_seq) installed.head_seq++;
+    installed.tail_seq = installed.head_seq;
+    io_write(fs, &installed, sizeof(installed), journal_base_off(&fs->geo));
+    io_flush(fs);
+    fs->jh = installed;
+    fs->log_end = installed.tail;
+    fs->log_end_seq = installed.tail_seq;
+
+    return commits;
+}
+
+int vsfs_install(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->mu);
+    journal_acquire(fs);
+    pthread_mutex_unlock(&fs->mu);
+
+    lock_fs(fs, LOCK_EX);
+    cache_refresh(fs);
+    int commits = journal_install(fs);
+    lock_fs(fs, LOCK_UN);
+
+    pthread_mutex_lock(&fs->mu);
+    journal_release(fs);
+    pthread_mutex_unlock(&fs->mu);
+    return commits;
+}
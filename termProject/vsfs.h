@@ -0,0 +1,111 @@
+#ifndef VSFS_H
+#define VSFS_H
+
+// Library interface to a VSFS image with metadata journaling.
+//
+// A handle replays the committed journal in vsfs_open (and again only when
+// another process has committed or installed in between) and then keeps
+// the resulting metadata blocks (inode bitmap, inode table, root directory)
+// in a block cache. Every later create is applied to that cache and logged,
+// so its cost does not depend on how much of the journal is still
+// uninstalled.
+//
+// Functions return 0 (or a count) on success and -1 on a filesystem-level
+// failure such as a duplicate name or a full journal, after printing the
+// reason to stderr. I/O errors on the image are fatal.
+
+#include <stdint.h>
+
+enum vsfs_sync
+{
+    VSFS_SYNC_NONE,       // no barriers; the page cache decides what reaches disk
+    VSFS_SYNC_COMMIT,     // one barrier after the whole transaction is written
+    VSFS_SYNC_ORDERED,    // records, barrier, commit record + header, barrier
+};
+
+struct vsfs;
+
+struct vsfs *vsfs_open(const char *path);
+void vsfs_close(struct vsfs *fs);
+
+void vsfs_set_sync(struct vsfs *fs, enum vsfs_sync mode);
+
+enum vsfs_io
+{
+    VSFS_IO_SYNC,     // pwrite and fdatasync, one system call each
+    VSFS_IO_URING,    // a commit's or an install's writes and barriers in one io_uring submission
+};
+
+// Returns -1, leaving the handle on VSFS_IO_SYNC, if the kernel has no io_uring.
+int vsfs_set_io(struct vsfs *fs, enum vsfs_io mode);
+
+// Metadata blocks are cached per handle, up to this many clean ones;
+// blocks whose committed contents are not installed yet always stay.
+#define VSFS_CACHE_BLOCKS 1024U
+
+struct vsfs_stats
+{
+    uint64_t cache_hits;
+    uint64_t cache_misses;      // blocks read from the image
+    uint64_t cache_evictions;
+    uint64_t commits;           // transactions written
+    uint64_t commit_requests;   // vsfs_create_many calls they carried
+    uint64_t journal_bytes;     // written to the journal region: records and headers
+    uint64_t data_bytes;        // file contents, written straight to data blocks
+    uint64_t syscalls;          // I/O and locking system calls on the image
+};
+
+void vsfs_get_stats(const struct vsfs *fs, struct vsfs_stats *st);
+
+// Once a commit leaves the journal at least this full (percent of its
+// capacity), or the next transaction would not fit, committed transactions
+// are installed inline before the call returns. 0 disables it and restores
+// the hard "journal full" failure.
+#define VSFS_DEFAULT_CHECKPOINT_PCT 75U
+void vsfs_set_checkpoint(struct vsfs *fs, unsigned percent);
+
+// Creates empty files in the root directory. vsfs_create_many applies all
+// names in one transaction; if any of them fails nothing is logged.
+//
+// A handle may be shared by threads. Calls that arrive while a commit is in
+// flight are queued and then logged together as one transaction, with one
+// commit record and one barrier sequence; each call still succeeds or fails
+// on its own. Handles in other processes are excluded with flock on the
+// image and pick up each other's commits before their next operation.
+int vsfs_create(struct vsfs *fs, const char *name);
+int vsfs_create_many(struct vsfs *fs, const char *const names[], unsigned nnames);
+
+// Replaces the contents of a file in the root directory, creating it if
+// needed, with everything read from src_fd up to end of file. The data is
+// streamed in runs of up to VSFS_FILE_CHUNK bytes straight into newly
+// allocated data blocks; only the bitmap, inode and directory changes are
+// journaled. Ordered mode, as in ext3: the data is written (and, unless
+// the sync mode is none, made durable) before the metadata is committed,
+// and the old blocks are freed by the same commit, so after a crash the
+// file has either its old or its new contents. Returns the bytes written.
+#define VSFS_FILE_CHUNK (1U << 20)
+int64_t vsfs_write_file(struct vsfs *fs, const char *name, int src_fd);
+
+// Copies the committed contents of a file in the root directory to out_fd.
+// Returns the bytes copied.
+int64_t vsfs_read_file(struct vsfs *fs, const char *name, int out_fd);
+
+// How long a group's leader waits for more callers before it commits
+// (default 0: only calls that queued behind the previous commit join).
+void vsfs_set_group_window(struct vsfs *fs, unsigned usec);
+
+// Checkpoints every committed transaction and empties the journal.
+// Returns the number of transactions installed.
+int vsfs_install(struct vsfs *fs);
+
+// Replays the committed part of an image's journal without opening the
+// image for writing: fn is called once per block the next install would
+// write, with the contents it would leave there. The image pointer is only
+// valid during the call. Returns the number of blocks, or -1 with a message
+// if the image has no usable superblock or its journal is an old-format one
+// that still holds records.
+int vsfs_journal_overlay(const char *path,
+                         void (*fn)(void *ctx, uint32_t block_no, const uint8_t *image),
+                         void *ctx);
+
+#endif
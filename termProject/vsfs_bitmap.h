@@ -0,0 +1,98 @@
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+// Allocation bitmaps shared by mkfs, journal and validator.
+//
+// Bit i lives in byte i / 8 at position i % 8, so on little-endian hosts a
+// 64-bit load holds bits [64w, 64w + 64) in order. Searches run a word at a
+// time; runs of completely full (or empty) words are skipped 32 bytes at a
+// time when built with AVX2, 16 with NEON. Buffers must be readable up to
+// the next 64-bit word boundary, which whole-block buffers always are.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static inline int vsfs_bitmap_test(const uint8_t *bm, uint32_t i) {
+    return (bm[i / 8U] >> (i % 8U)) & 0x1;
+}
+
+static inline void vsfs_bitmap_set(uint8_t *bm, uint32_t i) {
+    bm[i / 8U] |= (uint8_t)(1U << (i % 8U));
+}
+
+static inline void vsfs_bitmap_clear(uint8_t *bm, uint32_t i) {
+    bm[i / 8U] &= (uint8_t)~(1U << (i % 8U));
+}
+
+static inline uint64_t vsfs_bitmap_word(const uint8_t *bm, uint32_t w) {
+    uint64_t v;
+    memcpy(&v, bm + (size_t)w * 8U, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Returns the first word index >= w in [w, nwords) that differs from fill
+// (all zeros or all ones), or nwords.
+static inline uint32_t vsfs_bitmap_skip(const uint8_t *bm, uint32_t w, uint32_t nwords, uint64_t fill) {
+#if defined(__AVX2__)
+    const __m256i vfill = _mm256_set1_epi64x((long long)fill);
+    while (w + 4U <= nwords) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(bm + (size_t)w * 8U));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vfill)) != -1) {
+            break;
+        }
+        w += 4U;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t vfill = vdupq_n_u8((uint8_t)fill);
+    while (w + 2U <= nwords) {
+        uint8x16_t v = vld1q_u8(bm + (size_t)w * 8U);
+        if (vminvq_u8(vceqq_u8(v, vfill)) != 0xFFU) {
+            break;
+        }
+        w += 2U;
+    }
+#endif
+    while (w < nwords && vsfs_bitmap_word(bm, w) == fill) {
+        w++;
+    }
+    return w;
+}
+
+// First bit in [from, nbits) equal to `value`, or nbits if there is none.
+static inline uint32_t vsfs_bitmap_find(const uint8_t *bm, uint32_t from, uint32_t nbits, int value) {
+    if (from >= nbits) {
+        return nbits;
+    }
+    const uint64_t flip = value ? 0 : ~(uint64_t)0;
+    const uint32_t nwords = (nbits + 63U) / 64U;
+    uint32_t w = from / 64U;
+    uint64_t x = (vsfs_bitmap_word(bm, w) ^ flip) & (~(uint64_t)0 << (from % 64U));
+    while (x == 0) {
+        w = vsfs_bitmap_skip(bm, w + 1U, nwords, flip);
+        if (w >= nwords) {
+            return nbits;
+        }
+        x = vsfs_bitmap_word(bm, w) ^ flip;
+    }
+    uint32_t bit = w * 64U + (uint32_t)__builtin_ctzll(x);
+    return bit < nbits ? bit : nbits;
+}
+
+static inline uint32_t vsfs_bitmap_find_zero(const uint8_t *bm, uint32_t from, uint32_t nbits) {
+    return vsfs_bitmap_find(bm, from, nbits, 0);
+}
+
+static inline uint32_t vsfs_bitmap_find_set(const uint8_t *bm, uint32_t from, uint32_t nbits) {
+    return vsfs_bitmap_find(bm, from, nbits, 1);
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef VSFS_FORMAT_H
+#define VSFS_FORMAT_H
+
+// On-disk format shared by mkfs, journal and validator.
+//
+// Layout, in blocks:
+//   superblock | journal | inode bitmap | data bitmap | inode table | data
+// The superblock records where every region starts; region sizes follow
+// from the start of the next one, so one image format covers every
+// geometry mkfs can produce.
+
+#include <stdint.h>
+
+#define FS_MAGIC 0x56534653U
+
+#define BLOCK_SIZE        4096U
+#define INODE_SIZE         128U
+#define NAME_LEN            28U
+#define DIRECT_POINTERS      8U
+#define INODE_EXTENTS        4U
+#define EXTENTS_PER_BLOCK  (BLOCK_SIZE / 8U)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+
+#define SB_BLOCK_NO          0U
+#define JOURNAL_START_BLK    1U
+
+// Geometry of the reference image: 64 inodes, 256 KiB of data.
+#define DEFAULT_JOURNAL_BLOCKS  16U
+#define DEFAULT_INODE_COUNT     64U
+#define DEFAULT_DATA_BLOCKS     64U
+
+// Journal offsets and record sizes are 32-bit.
+#define MAX_JOURNAL_BLOCKS   65536U
+
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+
+    uint8_t  _pad[128 - 9 * 4];
+};
+
+// A run of len consecutive data blocks starting at block start.
+struct extent {
+    uint32_t start;
+    uint32_t len;
+};
+
+#define INODE_FLAG_EXTENTS 0x1U
+
+// Inodes written before extents map their blocks with direct[], one
+// pointer per block. With INODE_FLAG_EXTENTS the same bytes hold the first
+// INODE_EXTENTS extents and extent_block names a block of EXTENTS_PER_BLOCK
+// more; in both places a zero length ends the list. The extents map the
+// file's blocks in order and together cover exactly its size.
+struct inode {
+    uint16_t type;
+    uint16_t links;
+    uint32_t size;
+
+    union {
+        uint32_t direct[DIRECT_POINTERS];
+        struct extent extents[INODE_EXTENTS];
+    };
+
+    uint32_t ctime;
+    uint32_t mtime;
+
+    // Directories: block holding the hashed name index, 0 if unindexed.
+    uint32_t index_block;
+
+    uint32_t flags;
+    uint32_t extent_block;    // 0 until the inline extents first overflow; kept once allocated
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + 4 + 4)];
+};
+
+struct dirent {
+    uint32_t inode;
+    char name[NAME_LEN];
+};
+
+_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "inode must be 128 bytes");
+_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+_Static_assert(sizeof(struct extent) * INODE_EXTENTS == DIRECT_POINTERS * 4U, "inline extents must overlay direct[]");
+
+// Directories grow one dirent block at a time, up to the DIR_MAX_BLOCKS
+// that direct pointers could map. The index block is an open-addressed table of 16-bit slots, each holding
+// a dirent position + 1 (0 = empty); entries start probing at their name
+// hash and move linearly. There is no unlink, so no tombstones.
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / 32U)
+#define DIR_MAX_BLOCKS     DIRECT_POINTERS
+#define DIR_MAX_ENTRIES    (DIR_MAX_BLOCKS * DIRENTS_PER_BLOCK)
+#define DIR_INDEX_SLOTS    (BLOCK_SIZE / 2U)
+
+_Static_assert(DIR_INDEX_SLOTS >= 2U * DIR_MAX_ENTRIES, "directory index must stay at most half full");
+_Static_assert(DIR_MAX_ENTRIES < 0xFFFFU, "dirent positions must fit an index slot");
+
+// FNV-1a over the NUL-terminated name.
+static inline uint32_t vsfs_name_hash(const char *name) {
+    uint32_t h = 2166136261U;
+    for (uint32_t i = 0; i < NAME_LEN && name[i] != '\0'; ++i) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static inline uint32_t vsfs_dir_index_home(const char *name) {
+    return vsfs_name_hash(name) & (DIR_INDEX_SLOTS - 1U);
+}
+
+static inline uint32_t vsfs_dir_index_next(uint32_t slot) {
+    return (slot + 1U) & (DIR_INDEX_SLOTS - 1U);
+}
+
+struct vsfs_geometry {
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t inode_bmap_start;
+    uint32_t inode_bmap_blocks;
+    uint32_t data_bmap_start;
+    uint32_t data_bmap_blocks;
+    uint32_t inode_start;
+    uint32_t inode_blocks;
+    uint32_t data_start;
+    uint32_t data_blocks;
+};
+
+static inline uint32_t vsfs_div_round_up(uint32_t n, uint32_t d) {
+    return (n + d - 1U) / d;
+}
+
+// Lays out a new filesystem. Returns NULL on success or a description of
+// the parameter that is out of range.
+static inline const char *vsfs_geometry_make(struct vsfs_geometry *g,
+                                             uint32_t journal_blocks,
+                                             uint32_t inode_count,
+                                             uint32_t data_blocks) {
+    if (journal_blocks < 1U || journal_blocks > MAX_JOURNAL_BLOCKS) {
+        return "journal size out of range";
+    }
+    if (inode_count < 1U || inode_count > (1U << 28)) {
+        return "inode count out of range";
+    }
+    // the root directory needs its dirent block and its index block
+    if (data_blocks < 2U || data_blocks > (1U << 28)) {
+        return "data size out of range";
+    }
+
+    g->inode_count = inode_count;
+    g->journal_start = JOURNAL_START_BLK;
+    g->journal_blocks = journal_blocks;
+    g->inode_bmap_start = g->journal_start + journal_blocks;
+    g->inode_bmap_blocks = vsfs_div_round_up(inode_count, BITS_PER_BLOCK);
+    g->data_bmap_start = g->inode_bmap_start + g->inode_bmap_blocks;
+    g->data_bmap_blocks = vsfs_div_round_up(data_blocks, BITS_PER_BLOCK);
+    g->inode_start = g->data_bmap_start + g->data_bmap_blocks;
+    g->inode_blocks = vsfs_div_round_up(inode_count, INODES_PER_BLOCK);
+    g->data_start = g->inode_start + g->inode_blocks;
+    g->data_blocks = data_blocks;
+    g->total_blocks = g->data_start + data_blocks;
+    return NULL;
+}
+
+static inline void vsfs_geometry_to_sb(const struct vsfs_geometry *g, struct superblock *sb) {
+    sb->magic = FS_MAGIC;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = g->total_blocks;
+    sb->inode_count = g->inode_count;
+    sb->journal_block = g->journal_start;
+    sb->inode_bitmap = g->inode_bmap_start;
+    sb->data_bitmap = g->data_bmap_start;
+    sb->inode_start = g->inode_start;
+    sb->data_start = g->data_start;
+}
+
+// Derives the region sizes from a superblock. Returns NULL on success or a
+// description of the first inconsistency.
+static inline const char *vsfs_geometry_from_sb(const struct superblock *sb,
+                                                struct vsfs_geometry *g) {
+    if (sb->magic != FS_MAGIC) {
+        return "invalid superblock magic";
+    }
+    if (sb->block_size != BLOCK_SIZE) {
+        return "unexpected block size";
+    }
+    if (sb->journal_block != JOURNAL_START_BLK ||
+        sb->inode_bitmap <= sb->journal_block ||
+        sb->data_bitmap <= sb->inode_bitmap ||
+        sb->inode_start <= sb->data_bitmap ||
+        sb->data_start <= sb->inode_start ||
+        sb->total_blocks <= sb->data_start) {
+        return "superblock regions out of order";
+    }
+
+    g->total_blocks = sb->total_blocks;
+    g->inode_count = sb->inode_count;
+    g->journal_start = sb->journal_block;
+    g->journal_blocks = sb->inode_bitmap - sb->journal_block;
+    g->inode_bmap_start = sb->inode_bitmap;
+    g->inode_bmap_blocks = sb->data_bitmap - sb->inode_bitmap;
+    g->data_bmap_start = sb->data_bitmap;
+    g->data_bmap_blocks = sb->inode_start - sb->data_bitmap;
+    g->inode_start = sb->inode_start;
+    g->inode_blocks = sb->data_start - sb->inode_start;
+    g->data_start = sb->data_start;
+    g->data_blocks = sb->total_blocks - sb->data_start;
+
+    if (g->journal_blocks > MAX_JOURNAL_BLOCKS) {
+        return "journal larger than supported";
+    }
+    if (g->inode_count == 0 || g->inode_count > g->inode_blocks * INODES_PER_BLOCK) {
+        return "inode count does not match inode table size";
+    }
+    if ((uint64_t)g->inode_bmap_blocks * BITS_PER_BLOCK < g->inode_count) {
+        return "inode bitmap too small for inode count";
+    }
+    if ((uint64_t)g->data_bmap_blocks * BITS_PER_BLOCK < g->data_blocks) {
+        return "data bitmap too small for data region";
+    }
+    return NULL;
+}
+
+#endif